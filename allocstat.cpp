@@ -0,0 +1,73 @@
+#include "allocstat.h"
+
+#include <cerrno>
+#include <cstddef>
+
+// 初始化为常量的线程局部变量,访问时不会再分配内存
+static thread_local uint64_t allocCount = 0;
+static thread_local unsigned int allocScopes = 0;
+
+AllocCounter::AllocCounter() : m_begin(allocCount) { ++allocScopes; }
+
+AllocCounter::~AllocCounter() { --allocScopes; }
+
+uint64_t AllocCounter::Count() const { return allocCount - m_begin; }
+
+#if defined(COUNT_ALLOCS)
+
+bool AllocCounter::Enabled() { return true; }
+
+// new/new[]/对齐new最终都走到这里,转给glibc的__libc_*入口
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t num, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t align, size_t size);
+
+static inline void countAlloc() {
+  if (allocScopes > 0) {
+    ++allocCount;
+  }
+}
+
+void *malloc(size_t size) {
+  countAlloc();
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size) {
+  countAlloc();
+  return __libc_calloc(num, size);
+}
+
+void *realloc(void *p, size_t size) {
+  countAlloc();
+  return __libc_realloc(p, size);
+}
+
+void *memalign(size_t align, size_t size) {
+  countAlloc();
+  return __libc_memalign(align, size);
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+  countAlloc();
+  return __libc_memalign(align, size);
+}
+
+int posix_memalign(void **pp, size_t align, size_t size) {
+  countAlloc();
+  void *p = __libc_memalign(align, size);
+  if (p == nullptr) {
+    return ENOMEM;
+  }
+  *pp = p;
+  return 0;
+}
+}
+
+#else
+
+bool AllocCounter::Enabled() { return false; }
+
+#endif
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+  统计作用域内本线程的内存分配次数,给server.cpp中的性能测试使用
+  计数需要替换malloc系列函数,默认不编译,编译选项加-DCOUNT_ALLOCS才生效
+  未生效时Enabled返回false,Count总是0,不影响libc的分配器
+*/
+class AllocCounter {
+ public:
+  AllocCounter();
+  AllocCounter(const AllocCounter &) = delete;
+  AllocCounter &operator=(const AllocCounter &) = delete;
+  ~AllocCounter();
+  uint64_t Count() const;
+  static bool Enabled();
+
+ private:
+  uint64_t m_begin;
+};
@@ -82,8 +82,9 @@ const char descriptor_table_protodef_ctogo_2eproto[] PROTOBUF_SECTION_VARIABLE(p
   "\n\013ctogo.proto\"$\n\020QueryUserInfoReq\022\020\n\010Use"
   "rName\030\001 \001(\t\"E\n\020QueryUserInfoRsp\022\020\n\010UserN"
   "ame\030\001 \001(\t\022\020\n\010Password\030\002 \001(\t\022\r\n\005Money\030\003 \001"
-  "(\007*,\n\005CmdID\022\016\n\nHEART_BEAT\020\000\022\023\n\017QUERY_USE"
-  "R_INFO\020\001b\006proto3"
+  "(\007*F\n\005CmdID\022\016\n\nHEART_BEAT\020\000\022\023\n\017QUERY_USE"
+  "R_INFO\020\001\022\030\n\024QUERY_USER_INFO_FLAT\020\002b\006prot"
+  "o3"
   ;
 static const ::PROTOBUF_NAMESPACE_ID::internal::DescriptorTable*const descriptor_table_ctogo_2eproto_deps[1] = {
 };
@@ -93,7 +94,7 @@ static ::PROTOBUF_NAMESPACE_ID::internal::SCCInfoBase*const descriptor_table_cto
 };
 static ::PROTOBUF_NAMESPACE_ID::internal::once_flag descriptor_table_ctogo_2eproto_once;
 const ::PROTOBUF_NAMESPACE_ID::internal::DescriptorTable descriptor_table_ctogo_2eproto = {
-  false, false, descriptor_table_protodef_ctogo_2eproto, "ctogo.proto", 176,
+  false, false, descriptor_table_protodef_ctogo_2eproto, "ctogo.proto", 202,
   &descriptor_table_ctogo_2eproto_once, descriptor_table_ctogo_2eproto_sccs, descriptor_table_ctogo_2eproto_deps, 2, 0,
   schemas, file_default_instances, TableStruct_ctogo_2eproto::offsets,
   file_level_metadata_ctogo_2eproto, 2, file_level_enum_descriptors_ctogo_2eproto, file_level_service_descriptors_ctogo_2eproto,
@@ -109,6 +110,7 @@ bool CmdID_IsValid(int value) {
   switch (value) {
     case 0:
     case 1:
+    case 2:
       return true;
     default:
       return false;
@@ -68,12 +68,13 @@ PROTOBUF_NAMESPACE_CLOSE
 enum CmdID : int {
   HEART_BEAT = 0,
   QUERY_USER_INFO = 1,
+  QUERY_USER_INFO_FLAT = 2,
   CmdID_INT_MIN_SENTINEL_DO_NOT_USE_ = std::numeric_limits<::PROTOBUF_NAMESPACE_ID::int32>::min(),
   CmdID_INT_MAX_SENTINEL_DO_NOT_USE_ = std::numeric_limits<::PROTOBUF_NAMESPACE_ID::int32>::max()
 };
 bool CmdID_IsValid(int value);
 constexpr CmdID CmdID_MIN = HEART_BEAT;
-constexpr CmdID CmdID_MAX = QUERY_USER_INFO;
+constexpr CmdID CmdID_MAX = QUERY_USER_INFO_FLAT;
 constexpr int CmdID_ARRAYSIZE = CmdID_MAX + 1;
 
 const ::PROTOBUF_NAMESPACE_ID::EnumDescriptor* CmdID_descriptor();
@@ -0,0 +1,93 @@
+// 由rpcgen根据ctogo.proto生成,不要手工修改
+#pragma once
+
+#include "ctogo.pb.h"
+#include "flatmsg.h"
+#include "protorpcserver.h"
+
+// QueryUserInfoReq的flat格式
+class QueryUserInfoReqFlat : public FlatMsg {
+ public:
+  QueryUserInfoReqFlat() : FlatMsg(1) {}
+  FlatStr username() const { return getStr(0); }
+  void set_username(const std::string &v) {
+    setStr(0, v.data(), v.size());
+  }
+  void set_username(const char *p, size_t n) { setStr(0, p, n); }
+};
+
+// QueryUserInfoRsp的flat格式
+class QueryUserInfoRspFlat : public FlatMsg {
+ public:
+  QueryUserInfoRspFlat() : FlatMsg(3) {}
+  FlatStr username() const { return getStr(0); }
+  void set_username(const std::string &v) {
+    setStr(0, v.data(), v.size());
+  }
+  void set_username(const char *p, size_t n) { setStr(0, p, n); }
+  FlatStr password() const { return getStr(1); }
+  void set_password(const std::string &v) {
+    setStr(1, v.data(), v.size());
+  }
+  void set_password(const char *p, size_t n) { setStr(1, p, n); }
+  uint32_t money() const { return getScalar<uint32_t>(2); }
+  void set_money(uint32_t v) { setScalar(2, v); }
+};
+
+// cmd对应的请求/应答类型,编译期确定
+template <uint16_t CMD>
+struct CtogoTraits;
+
+template <>
+struct CtogoTraits<QUERY_USER_INFO> {
+  typedef QueryUserInfoReq Req;
+  typedef QueryUserInfoRsp Rsp;
+};
+
+template <>
+struct CtogoTraits<QUERY_USER_INFO_FLAT> {
+  typedef QueryUserInfoReqFlat Req;
+  typedef QueryUserInfoRspFlat Rsp;
+};
+
+// 按cmd注册服务端handler,请求/应答类型由cmd确定
+template <uint16_t CMD>
+void RegisterCtogo(
+    ProtoRPCServer &server,
+    std::function<ErrNo(GoContext &, const typename CtogoTraits<CMD>::Req &,
+                        typename CtogoTraits<CMD>::Rsp &)>
+        handler,
+    bool pooled = false) {
+  typedef typename CtogoTraits<CMD>::Req Req;
+  typedef typename CtogoTraits<CMD>::Rsp Rsp;
+  server.Register<Req, Rsp>(CMD, std::move(handler), pooled);
+}
+
+class CtogoRPC : public ProtoRPC {
+ public:
+  // QUERY_USER_INFO
+  std::tuple<QueryUserInfoRsp, ErrNo> QueryUserInfo(
+      GoContext *ctx, const QueryUserInfoReq &req,
+      unsigned int timeoutMs = CALL_TIMEOUT_MS,
+      CallPriority priority = PRIORITY_INTERACTIVE) {
+    return Invoke<QUERY_USER_INFO>(ctx, req, timeoutMs, priority);
+  }
+  // QUERY_USER_INFO_FLAT
+  // rsp直接引用收到的字节,有效期见ProtoRPC::Call
+  ErrNo QueryUserInfoFlat(
+      GoContext *ctx, const QueryUserInfoReqFlat &req,
+      QueryUserInfoRspFlat &rsp, unsigned int timeoutMs = CALL_TIMEOUT_MS,
+      CallPriority priority = PRIORITY_INTERACTIVE) {
+    return Call(ctx, QUERY_USER_INFO_FLAT, req, rsp, timeoutMs, priority);
+  }
+
+ protected:
+  template <uint16_t CMD>
+  std::tuple<typename CtogoTraits<CMD>::Rsp, ErrNo> Invoke(
+      GoContext *ctx, const typename CtogoTraits<CMD>::Req &req,
+      unsigned int timeoutMs, CallPriority priority) {
+    typename CtogoTraits<CMD>::Rsp rsp;
+    ErrNo err = Call(ctx, CMD, req, rsp, timeoutMs, priority);
+    return std::make_tuple(std::move(rsp), err);
+  }
+};
@@ -1,9 +1,17 @@
 #include "epoll.h"
 
+#include <sys/eventfd.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
 #include <ctime>
+#include <iterator>
+
+#include "gooffload.h"
 
 time_t curtime() {
   timespec ts;
@@ -16,23 +24,105 @@ time_t curtime() {
   return time(NULL);
 }
 
-void goimpl(GoContext *pctx, std::function<void(GoContext &)> func,
-            boost::coroutines2::coroutine<void>::pull_type &pull) {
-  pctx->m_yield = &pull;
-  func(*pctx);
-  pctx->GetEpoll()->release(pctx);
+uint64_t curtimems() {
+  timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+    return uint64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+  }
+  return uint64_t(time(NULL)) * 1000;
 }
 
-GoContext::GoContext(Epoll *e, std::function<void(GoContext &)> func,
-                     std::size_t stackSize)
-    : m_self(boost::coroutines2::fixedsize_stack(stackSize),
-             std::bind(goimpl, this, std::move(func), std::placeholders::_1)) {
-  m_epoll = e;
-  m_yield = nullptr;
+uint64_t curtimeus() {
+  timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+    return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+  }
+  return uint64_t(time(NULL)) * 1000000;
+}
+
+namespace {
+// 每种大小的空闲栈最多缓存的字节数
+const size_t MAX_FREE_STACK_BYTES = 64 * 1024 * 1024;
+
+// 栈由Epoll分配和回收,fiber结束时不释放
+struct PooledStack {
+  boost::context::stack_context allocate() {
+    return boost::context::stack_context();
+  }
+  void deallocate(boost::context::stack_context &) {}
+};
+}  // namespace
+
+GoContext::GoContext(Epoll *e, char *stack, std::size_t stackSize,
+                     std::size_t used, void *func, RunFunc run,
+                     DestroyFunc destroy)
+    : m_epoll(e),
+      m_stack(stack),
+      m_stackSize(stackSize),
+      m_func(func),
+      m_run(run),
+      m_destroy(destroy),
+      m_background(false) {
+  boost::context::stack_context sctx;
+  sctx.size = stackSize;
+  sctx.sp = stack + stackSize;
+  m_fiber = boost::context::fiber(
+      std::allocator_arg,
+      boost::context::preallocated(stack + used, used, sctx), PooledStack(),
+      [this](boost::context::fiber &&caller) {
+        return this->run(std::move(caller));
+      });
+}
+
+boost::context::fiber GoContext::run(boost::context::fiber &&caller) {
+  m_caller = std::move(caller);
+  m_run(m_func, *this);
+  m_destroy(m_func);
+  m_func = nullptr;
+  m_epoll->release(this);
+  return std::move(m_caller);
+}
+
+ErrNo GoContext::offload(OffloadJob *job) {
+  if (m_epoll->m_offload == nullptr) {
+    return ENOSYS;
+  }
+  ErrNo err = m_epoll->m_offload->Submit(job);
+  if (err != 0) {
+    return err;
+  }
+  Out();
+  return 0;
+}
+
+void GoContext::Yield() {
+  m_epoll->yield(this);
+  Out();
 }
 
 void GoContext::Sleep(unsigned int s) { m_epoll->sleep(this, s); }
 
+void GoContext::SleepMs(unsigned int ms) {
+  if (ms == 0) {
+    return;
+  }
+  GoTimer timer(m_epoll);
+  GoContext *self = this;
+  Epoll *e = m_epoll;
+  timer.Start(ms, [self, e]() { e->push([self]() { self->In(); }); });
+  Out();
+}
+
+bool Selector::Fire(int index) {
+  if (m_fired >= 0) {
+    return false;
+  }
+  m_fired = index;
+  GoContext *ctx = m_ctx;
+  ctx->GetEpoll()->push([ctx]() { ctx->In(); });
+  return true;
+}
+
 bool GoChan::Wake() {
   if (m_wait == nullptr) {
     return false;
@@ -43,11 +133,120 @@ bool GoChan::Wake() {
   return true;
 }
 
-Epoll::Epoll() {
+bool GoChan::Resume() {
+  if (m_wait == nullptr) {
+    return false;
+  }
+  auto ctx = m_wait;
+  m_wait = nullptr;
+  ctx->In();
+  return true;
+}
+
+GoTimer::GoTimer(Epoll *e) {
+  Prev = nullptr;
+  Next = nullptr;
+  m_epoll = e;
+  m_expire = 0;
+  m_slot = 0;
+}
+
+void GoTimer::Start(unsigned int ms, std::function<void()> func) {
+  Stop();
+  if (ms == 0) {
+    ms = 1;
+  }
+  m_expire = curtimems() + ms;
+  m_func = std::move(func);
+  m_epoll->addTimer(this);
+}
+
+void GoTimer::Stop() {
+  if (Prev == nullptr) {
+    return;
+  }
+  m_epoll->delTimer(this);
+  m_func = nullptr;
+}
+
+PostQueue::PostQueue(Epoll *e) {
+  m_epoll = e;
+  m_fd = -1;
+}
+
+PostQueue::~PostQueue() {
+  if (m_fd != -1) {
+    close(m_fd);
+  }
+}
+
+ErrNo PostQueue::Open() {
+  m_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_fd == -1) {
+    return errno;
+  }
+  ErrNo err = m_epoll->add(m_fd, this);
+  if (err != 0) {
+    close(m_fd);
+    m_fd = -1;
+  }
+  return err;
+}
+
+void PostQueue::Post(std::function<void()> func) {
+  bool wake = false;
+  {
+    std::lock_guard<std::mutex> guard(m_lock);
+    wake = m_funcs.empty();
+    m_funcs.push_back(std::move(func));
+  }
+  if (!wake) {
+    return;
+  }
+  uint64_t value = 1;
+  if (write(m_fd, &value, sizeof(value)) != sizeof(value)) {
+    fprintf(stderr, "%s:%d post notify failed:%s\n", __FILE__, __LINE__,
+            strerror(errno));
+  }
+}
+
+// 先清空eventfd再取队列,取走之后投递的函数会再次写eventfd
+void PostQueue::OnIn() {
+  uint64_t value;
+  while (read(m_fd, &value, sizeof(value)) == sizeof(value)) {
+  }
+  {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_recv.swap(m_funcs);
+  }
+  for (auto &func : m_recv) {
+    m_epoll->push(std::move(func));
+  }
+  m_recv.clear();
+}
+
+Epoll::Epoll() : m_posts(this) {
   m_epollFd = -1;
   m_del = nullptr;
+  m_offload = nullptr;
+  m_lowHead = 0;
+  m_budgetItems = 0;
+  m_budgetUs = 0;
   m_baseTime = curtime();
   m_timeIndex = 0;
+  m_msNow = curtimems();
+  m_timerCount = 0;
+  for (auto &level : m_msWheel) {
+    for (auto &v : level) {
+      v.Prev = &v;
+      v.Next = &v;
+    }
+  }
+  for (auto &v : m_timerBits) {
+    v = 0;
+  }
+  m_nextExpire = 0;
+  m_nextValid = false;
 }
 
 Epoll::~Epoll() {
@@ -55,7 +254,12 @@ Epoll::~Epoll() {
     close(m_epollFd);
   }
   if (m_del != nullptr) {
-    delete m_del;
+    recycle(m_del);
+  }
+  for (auto &v : m_stacks) {
+    for (auto stack : v.second) {
+      ::operator delete(stack);
+    }
   }
 }
 
@@ -64,7 +268,7 @@ ErrNo Epoll::Create() {
   if (m_epollFd == -1) {
     return errno;
   }
-  return 0;
+  return m_posts.Open();
 }
 
 ErrNo Epoll::add(int s, INotify *pnotify) {
@@ -97,21 +301,66 @@ void Epoll::push(std::function<void()> func) {
   m_funcs.push_back(std::move(func));
 }
 
-void Epoll::Go(std::function<void(GoContext &)> func, std::size_t stackSize) {
-  auto pctx = new GoContext(this, std::move(func), stackSize);
-  push([pctx]() { pctx->In(); });
+void Epoll::yield(GoContext *pctx) { m_yields.push_back(pctx); }
+
+/*
+  m_funcs整批换到m_running中执行,执行中新加入的函数在本轮继续执行
+  普通队列为空时才从低优先级队列取一个执行
+  超出预算时停止,剩下的放回队列开头,下一轮先执行
+*/
+void Epoll::runQueue() {
+  uint64_t begin = curtimeus();
+  size_t count = 0;
+  size_t i = 0;
+  while (true) {
+    if (i == m_running.size()) {
+      m_running.clear();
+      i = 0;
+      if (!m_funcs.empty()) {
+        m_running.swap(m_funcs);
+      } else if (m_lowHead < m_lowFuncs.size()) {
+        m_running.push_back(std::move(m_lowFuncs[m_lowHead++]));
+      } else {
+        break;
+      }
+    }
+    m_running[i++]();
+    ++count;
+    if (m_budgetItems != 0 && count >= m_budgetItems) {
+      break;
+    }
+    // 每16个检查一次时间
+    if (m_budgetUs != 0 && count % 16 == 0 &&
+        curtimeus() - begin >= m_budgetUs) {
+      break;
+    }
+  }
+  if (i < m_running.size()) {
+    m_funcs.insert(m_funcs.begin(),
+                   std::make_move_iterator(m_running.begin() + i),
+                   std::make_move_iterator(m_running.end()));
+  }
+  m_running.clear();
+  m_lowFuncs.erase(m_lowFuncs.begin(), m_lowFuncs.begin() + m_lowHead);
+  m_lowHead = 0;
+  for (auto pctx : m_yields) {
+    auto &queue = pctx->m_background ? m_lowFuncs : m_funcs;
+    queue.push_back([pctx]() { pctx->In(); });
+  }
+  m_yields.clear();
 }
 
 ErrNo Epoll::Wait(int ms) {
   onTime();
-  decltype(m_funcs.size()) i = 0;
-  while (i < m_funcs.size()) {
-    (m_funcs[i])();
-    ++i;
+  onTimer();
+  runQueue();
+  // 还有排队的函数时只收取已经就绪的事件
+  int timeout = 0;
+  if (m_funcs.empty() && m_lowFuncs.empty()) {
+    timeout = nextTimeout(ms);
   }
-  m_funcs.clear();
   int iwait = epoll_wait(m_epollFd, m_events,
-                         sizeof(m_events) / sizeof(m_events[0]), ms);
+                         sizeof(m_events) / sizeof(m_events[0]), timeout);
   if (iwait < 0) {
     int err = errno;
     if (err == EINTR) {
@@ -140,11 +389,38 @@ ErrNo Epoll::Wait(int ms) {
 
 void Epoll::release(GoContext *pctx) {
   if (m_del != nullptr) {
-    delete m_del;
+    recycle(m_del);
   }
   m_del = pctx;
 }
 
+char *Epoll::allocStack(std::size_t stackSize) {
+  auto it = m_stacks.find(stackSize);
+  if (it == m_stacks.end() || it->second.empty()) {
+    return static_cast<char *>(::operator new(stackSize));
+  }
+  char *stack = it->second.back();
+  it->second.pop_back();
+  return stack;
+}
+
+void Epoll::freeStack(char *stack, std::size_t stackSize) {
+  auto &stacks = m_stacks[stackSize];
+  if ((stacks.size() + 1) * stackSize > MAX_FREE_STACK_BYTES) {
+    ::operator delete(stack);
+    return;
+  }
+  stacks.push_back(stack);
+}
+
+// GoContext在自己的栈上,切出协程的In返回之后才能回收
+void Epoll::recycle(GoContext *pctx) {
+  char *stack = pctx->m_stack;
+  std::size_t stackSize = pctx->m_stackSize;
+  pctx->~GoContext();
+  freeStack(stack, stackSize);
+}
+
 void Epoll::onTime() {
   time_t now = curtime();
   auto sub = now - m_baseTime;
@@ -179,4 +455,190 @@ void Epoll::sleep(GoContext *pctx, unsigned int s) {
   }
   m_timeWheel[(m_timeIndex + s) % MaxSleep].push_back(pctx);
   pctx->Out();
+}
+
+static const uint64_t TIMER_WHEEL_MASK = TIMER_WHEEL_SLOTS - 1;
+static const uint64_t TIMER_WHEEL_SPAN =
+    uint64_t(1) << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+
+void Epoll::addTimer(GoTimer *ptimer) {
+  placeTimer(ptimer);
+  ++m_timerCount;
+  if (m_nextValid && ptimer->m_expire < m_nextExpire) {
+    m_nextExpire = ptimer->m_expire;
+  }
+}
+
+void Epoll::delTimer(GoTimer *ptimer) {
+  ptimer->Prev->Next = ptimer->Next;
+  ptimer->Next->Prev = ptimer->Prev;
+  ptimer->Prev = nullptr;
+  ptimer->Next = nullptr;
+  unsigned int level = ptimer->m_slot / TIMER_WHEEL_SLOTS;
+  unsigned int index = ptimer->m_slot % TIMER_WHEEL_SLOTS;
+  TimerNode *head = &m_msWheel[level][index];
+  if (head->Next == head) {
+    m_timerBits[level] &= ~(uint64_t(1) << index);
+  }
+  --m_timerCount;
+  if (m_nextValid && ptimer->m_expire <= m_nextExpire) {
+    m_nextValid = false;
+  }
+}
+
+// 离m_msNow的距离在[64^level, 64^(level+1))之间的放在第level层
+void Epoll::placeTimer(GoTimer *ptimer) {
+  uint64_t expire = ptimer->m_expire;
+  if (expire < m_msNow) {
+    expire = m_msNow;
+  }
+  if (expire - m_msNow >= TIMER_WHEEL_SPAN) {
+    expire = m_msNow + TIMER_WHEEL_SPAN - 1;
+  }
+  uint64_t delta = expire - m_msNow;
+  unsigned int level = 0;
+  while (level + 1 < TIMER_WHEEL_LEVELS &&
+         delta >= (uint64_t(1) << (TIMER_WHEEL_BITS * (level + 1)))) {
+    ++level;
+  }
+  unsigned int index =
+      (expire >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+  TimerNode *head = &m_msWheel[level][index];
+  ptimer->Prev = head->Prev;
+  ptimer->Next = head;
+  head->Prev->Next = ptimer;
+  head->Prev = ptimer;
+  ptimer->m_slot = level * TIMER_WHEEL_SLOTS + index;
+  m_timerBits[level] |= uint64_t(1) << index;
+}
+
+// 最低层转完一圈时,把上一层当前槽的定时器按剩余时间重新放到低层
+void Epoll::cascadeTimers() {
+  for (unsigned int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+    unsigned int index =
+        (m_msNow >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    TimerNode *head = &m_msWheel[level][index];
+    if (head->Next != head) {
+      TimerNode *node = head->Next;
+      head->Prev->Next = nullptr;
+      head->Prev = head;
+      head->Next = head;
+      m_timerBits[level] &= ~(uint64_t(1) << index);
+      while (node != nullptr) {
+        TimerNode *next = node->Next;
+        placeTimer(static_cast<GoTimer *>(node));
+        node = next;
+      }
+    }
+    if (index != 0) {
+      break;
+    }
+  }
+}
+
+void Epoll::onTimer() {
+  uint64_t now = curtimems();
+  if (m_timerCount == 0) {
+    if (now >= m_msNow) {
+      m_msNow = now + 1;
+    }
+    return;
+  }
+  TimerNode expired;
+  expired.Prev = &expired;
+  expired.Next = &expired;
+  while (m_msNow <= now) {
+    unsigned int index = m_msNow & TIMER_WHEEL_MASK;
+    if (index == 0) {
+      cascadeTimers();
+    } else if ((m_timerBits[0] >> index) == 0) {
+      // 最低层剩下的槽都是空的,直接跳到下一圈
+      m_msNow = std::min(now + 1, (m_msNow | TIMER_WHEEL_MASK) + 1);
+      continue;
+    }
+    // 最低层一个槽里的定时器都在m_msNow到期,整槽移走
+    TimerNode *head = &m_msWheel[0][index];
+    if (head->Next != head) {
+      head->Next->Prev = expired.Prev;
+      head->Prev->Next = &expired;
+      expired.Prev->Next = head->Next;
+      expired.Prev = head->Prev;
+      head->Prev = head;
+      head->Next = head;
+      m_timerBits[0] &= ~(uint64_t(1) << index);
+    }
+    ++m_msNow;
+  }
+  while (expired.Next != &expired) {
+    GoTimer *ptimer = static_cast<GoTimer *>(expired.Next);
+    auto func = std::move(ptimer->m_func);
+    delTimer(ptimer);
+    func();
+  }
+}
+
+/*
+  每层从当前位置起第一个非空槽里是该层最早的定时器
+  最低层一个槽只有一个到期时间,高层的槽只给出下界
+  下界不早于已知的最早时间就不必遍历该槽
+*/
+uint64_t Epoll::earliestTimer() {
+  if (m_nextValid) {
+    return m_nextExpire;
+  }
+  uint64_t best = UINT64_MAX;
+  for (unsigned int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    uint64_t bits = m_timerBits[level];
+    if (bits == 0) {
+      continue;
+    }
+    unsigned int shift = TIMER_WHEEL_BITS * level;
+    uint64_t base = m_msNow >> shift;
+    unsigned int cur = base & TIMER_WHEEL_MASK;
+    uint64_t rotated = bits >> cur;
+    if (cur != 0) {
+      rotated |= bits << (TIMER_WHEEL_SLOTS - cur);
+    }
+    uint64_t dist = __builtin_ctzll(rotated);
+    // m_msNow正好停在该层边界上时当前槽还没有降级,里面是本圈的,下界为m_msNow
+    // 否则当前槽已经降过级,里面只会是下一圈的
+    uint64_t low = (uint64_t(1) << shift) - 1;
+    if (level > 0 && dist == 0 && (m_msNow & low) != 0) {
+      dist = TIMER_WHEEL_SLOTS;
+    }
+    uint64_t lower = (base + dist) << shift;
+    if (lower >= best) {
+      continue;
+    }
+    if (level == 0) {
+      best = lower;
+      continue;
+    }
+    TimerNode *head = &m_msWheel[level][(cur + dist) & TIMER_WHEEL_MASK];
+    for (TimerNode *node = head->Next; node != head; node = node->Next) {
+      best = std::min(best, static_cast<GoTimer *>(node)->m_expire);
+    }
+  }
+  m_nextExpire = best;
+  m_nextValid = true;
+  return best;
+}
+
+int Epoll::nextTimeout(int ms) {
+  if (m_timerCount == 0) {
+    return ms;
+  }
+  uint64_t expire = earliestTimer();
+  uint64_t now = curtimems();
+  if (expire <= now) {
+    return 0;
+  }
+  uint64_t wait = expire - now;
+  if (ms >= 0 && uint64_t(ms) < wait) {
+    return ms;
+  }
+  if (wait > INT_MAX) {
+    wait = INT_MAX;
+  }
+  return int(wait);
 }
\ No newline at end of file
@@ -2,15 +2,23 @@
 
 #include <sys/epoll.h>
 
-#include <boost/coroutine2/all.hpp>
+#include <boost/context/fiber.hpp>
+#include <cstdint>
 #include <functional>
 #include <list>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 typedef int ErrNo;
 
 time_t curtime();
+uint64_t curtimems();
+uint64_t curtimeus();
 
 class INotify {
  public:
@@ -19,26 +27,83 @@ class INotify {
 };
 
 class Epoll;
+class GoContext;
+class OffloadPool;
+class AsyncTask;
+template <typename T, size_t N>
+class Chan;
+
+// Offload交给线程池的任务,节点在挂起协程的栈上
+struct OffloadJob {
+  void (*Call)(void *func);
+  void *Func;
+  GoContext *Ctx;
+  uint64_t QueueTime;
+  OffloadJob *Next;
+};
+
 class GoContext {
  public:
   GoContext(const GoContext &) = delete;
   GoContext &operator=(const GoContext &) = delete;
-  void Out() { (*m_yield)(); }
-  void In() { m_self(); }
+  // 切回恢复本协程的一方
+  void Out() { m_caller = std::move(m_caller).resume(); }
+  // 切入本协程,直到它Out或结束
+  void In() { m_fiber = std::move(m_fiber).resume(); }
   void Sleep(unsigned int s);
+  void SleepMs(unsigned int ms);
+  /*
+    在Epoll设置的OffloadPool中执行func,用于getaddrinfo、磁盘读写等阻塞调用
+    期间协程挂起,本Epoll上的其他协程照常运行,func返回后回到本Epoll继续
+    没有设置线程池返回ENOSYS,排队的任务已达上限返回EAGAIN,此时func没有执行
+  */
+  template <typename F>
+  ErrNo Offload(F &&func) {
+    typedef typename std::remove_reference<F>::type Func;
+    OffloadJob job;
+    job.Call = [](void *f) { (*static_cast<Func *>(f))(); };
+    job.Func = const_cast<void *>(static_cast<const void *>(&func));
+    job.Ctx = this;
+    job.QueueTime = 0;
+    job.Next = nullptr;
+    return offload(&job);
+  }
   Epoll *GetEpoll() { return m_epoll; }
+  // 让出CPU,本轮的epoll_wait处理完网络事件后再继续
+  void Yield();
+  // 后台协程Yield后进入低优先级队列,只在普通队列为空并且本轮预算有剩余时执行
+  void SetBackground(bool background) { m_background = background; }
 
  private:
   friend Epoll;
-  friend void goimpl(GoContext *pctx, std::function<void(GoContext &)> func,
-                     boost::coroutines2::coroutine<void>::pull_type &pull);
-  GoContext(Epoll *e, std::function<void(GoContext &)> func,
-            std::size_t stackSize);
+  typedef void (*RunFunc)(void *func, GoContext &ctx);
+  typedef void (*DestroyFunc)(void *func);
+  // stack开头的used字节给协程使用,其上是GoContext和func
+  GoContext(Epoll *e, char *stack, std::size_t stackSize, std::size_t used,
+            void *func, RunFunc run, DestroyFunc destroy);
+  boost::context::fiber run(boost::context::fiber &&caller);
+  ErrNo offload(OffloadJob *job);
+  template <typename F>
+  static void runFunc(void *func, GoContext &ctx) {
+    (*static_cast<F *>(func))(ctx);
+  }
+  template <typename F>
+  static void destroyFunc(void *func) {
+    static_cast<F *>(func)->~F();
+  }
 
  private:
   Epoll *m_epoll;
-  boost::coroutines2::coroutine<void>::push_type m_self;
-  boost::coroutines2::coroutine<void>::pull_type *m_yield;
+  char *m_stack;
+  std::size_t m_stackSize;
+  void *m_func;
+  RunFunc m_run;
+  DestroyFunc m_destroy;
+  bool m_background;
+  // 协程挂起时的上下文,结束后为空
+  boost::context::fiber m_fiber;
+  // 协程运行时恢复它的一方
+  boost::context::fiber m_caller;
 };
 
 class GoChan {
@@ -54,6 +119,8 @@ class GoChan {
     ctx->Out();
   }
   bool Wake();
+  // 在当前协程里直接切换到等待者,等待者下次挂起时回到这里继续
+  bool Resume();
   Epoll *GetEpoll() { return m_epoll; }
 
  private:
@@ -61,6 +128,86 @@ class GoChan {
   GoContext *m_wait;
 };
 
+// Select挂起期间各个等待源共享,第一个触发的源唤醒协程,之后的触发被忽略
+class Selector {
+ public:
+  explicit Selector(GoContext *ctx) {
+    m_ctx = ctx;
+    m_fired = -1;
+  }
+  Selector(const Selector &) = delete;
+  Selector &operator=(const Selector &) = delete;
+  // 第一次调用返回true并唤醒协程
+  bool Fire(int index);
+  int Fired() const { return m_fired; }
+  GoContext *Ctx() { return m_ctx; }
+
+ private:
+  GoContext *m_ctx;
+  int m_fired;
+};
+
+// 无栈协程(goawait.h)挂在socket上的等待者,socket就绪或关闭时回调
+class AsyncWaiter {
+ public:
+  virtual void OnReady() = 0;
+};
+
+struct TimerNode {
+  TimerNode *Prev;
+  TimerNode *Next;
+};
+
+// 毫秒时间轮共4层,每层64个槽,覆盖2^24毫秒(约4.6小时),更远的定时器停在最高层
+const unsigned int TIMER_WHEEL_BITS = 6;
+const unsigned int TIMER_WHEEL_SLOTS = 1 << TIMER_WHEEL_BITS;
+const unsigned int TIMER_WHEEL_LEVELS = 4;
+
+// 其他线程投递给Epoll的函数,队列由空变为非空时写eventfd唤醒epoll_wait
+class PostQueue : public INotify {
+ public:
+  PostQueue(Epoll *e);
+  PostQueue(const PostQueue &) = delete;
+  PostQueue &operator=(const PostQueue &) = delete;
+  ~PostQueue();
+  ErrNo Open();
+  void Post(std::function<void()> func);
+
+ private:
+  virtual void OnIn() override;
+  virtual void OnOut() override {}
+
+ private:
+  Epoll *m_epoll;
+  int m_fd;
+  std::mutex m_lock;
+  std::vector<std::function<void()>> m_funcs;
+  std::vector<std::function<void()>> m_recv;
+};
+
+/*
+  毫秒定时器,节点侵入式挂在Epoll的分层时间轮上
+  启动/取消为O(1),远期定时器随时间逐层下降,每层最多移动一次
+*/
+class GoTimer : private TimerNode {
+ public:
+  GoTimer(Epoll *e);
+  GoTimer(const GoTimer &) = delete;
+  GoTimer &operator=(const GoTimer &) = delete;
+  ~GoTimer() { Stop(); }
+  void Start(unsigned int ms, std::function<void()> func);
+  void Stop();
+  bool Active() { return Prev != nullptr; }
+
+ private:
+  friend Epoll;
+  Epoll *m_epoll;
+  uint64_t m_expire;
+  // 所在的层和槽,level * TIMER_WHEEL_SLOTS + index
+  unsigned int m_slot;
+  std::function<void()> m_func;
+};
+
 class Epoll {
  public:
   Epoll();
@@ -69,36 +216,107 @@ class Epoll {
   ~Epoll();
   ErrNo Create();
   ErrNo Wait(int ms);
-  void Go(std::function<void(GoContext &)> func,
-          std::size_t stackSize = 1024 * 1024 * 8);
+  /*
+    func直接构造在协程栈的顶部,GoContext紧挨在它下面,不经过std::function
+    栈按大小放回本Epoll的栈池,同样大小的协程复用,池中有栈时创建协程不分配内存
+  */
+  template <typename F>
+  void Go(F &&func, std::size_t stackSize = 1024 * 1024 * 8) {
+    typedef typename std::decay<F>::type Func;
+    char *stack = allocStack(stackSize);
+    uintptr_t base = reinterpret_cast<uintptr_t>(stack);
+    uintptr_t top = base + stackSize;
+    top = (top - sizeof(Func)) & ~uintptr_t(alignof(Func) - 1);
+    Func *pfunc =
+        new (reinterpret_cast<void *>(top)) Func(std::forward<F>(func));
+    top = (top - sizeof(GoContext)) & ~uintptr_t(alignof(GoContext) - 1);
+    GoContext *pctx = new (reinterpret_cast<void *>(top))
+        GoContext(this, stack, stackSize, top - base, pfunc,
+                  &GoContext::runFunc<Func>, &GoContext::destroyFunc<Func>);
+    push([pctx]() { pctx->In(); });
+  }
+  // 可以在任意线程调用,func在本Epoll的线程中执行,需要先Create
+  void Post(std::function<void()> func) { m_posts.Post(std::move(func)); }
+  /*
+    每轮Wait最多执行items个排队的函数或者执行us微秒,超出的部分留到下一轮,
+    中间先处理一次网络事件,0表示不限制(默认)
+  */
+  void SetRunBudget(size_t items, unsigned int us) {
+    m_budgetItems = items;
+    m_budgetUs = us;
+  }
+  // GoContext::Offload使用的线程池,可以由多个Epoll共用
+  void SetOffloadPool(OffloadPool *pool) { m_offload = pool; }
 
  private:
+  char *allocStack(std::size_t stackSize);
+  void freeStack(char *stack, std::size_t stackSize);
+  void recycle(GoContext *pctx);
   ErrNo add(int s, INotify *pnotify);
   void del(int s, INotify *pnotify);
   bool exist(INotify *pnotify);
   void push(std::function<void()> func);
+  void yield(GoContext *pctx);
+  void runQueue();
   void release(GoContext *pctx);
   void sleep(GoContext *pctx, unsigned int s);
   void tick();
   void onTime();
+  void addTimer(GoTimer *ptimer);
+  void delTimer(GoTimer *ptimer);
+  void placeTimer(GoTimer *ptimer);
+  void cascadeTimers();
+  uint64_t earliestTimer();
+  void onTimer();
+  int nextTimeout(int ms);
 
  private:
   friend class AcceptSocket;
   friend class TcpSocket;
   friend class UdpSocket;
+  friend class EventFd;
   friend GoChan;
+  friend Selector;
+  friend class GoWaitList;
+  friend class AsyncTask;
+  template <typename T, size_t N>
+  friend class Chan;
   friend GoContext;
-  friend void goimpl(GoContext *pctx, std::function<void(GoContext &)> func,
-                     boost::coroutines2::coroutine<void>::pull_type &pull);
+  friend GoTimer;
+  friend PostQueue;
 
  private:
   int m_epollFd;
   GoContext *m_del;
+  OffloadPool *m_offload;
+  // 按大小分开的空闲协程栈
+  std::unordered_map<std::size_t, std::vector<char *>> m_stacks;
   std::unordered_set<INotify *> m_notifies;
+  // 运行队列,执行时整批换到m_running
   std::vector<std::function<void()>> m_funcs;
+  std::vector<std::function<void()>> m_running;
+  // 后台协程Yield后的低优先级队列,m_lowHead之前的已经执行
+  std::vector<std::function<void()>> m_lowFuncs;
+  size_t m_lowHead;
+  // 本轮Yield的协程,本轮结束后才进入运行队列
+  std::vector<GoContext *> m_yields;
+  size_t m_budgetItems;
+  unsigned int m_budgetUs;
   epoll_event m_events[10000];
 
   time_t m_baseTime;
   size_t m_timeIndex;
   std::vector<GoContext *> m_timeWheel[60];
+
+  // 下一个待处理的毫秒
+  uint64_t m_msNow;
+  size_t m_timerCount;
+  TimerNode m_msWheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  // 每层非空槽的位图
+  uint64_t m_timerBits[TIMER_WHEEL_LEVELS];
+  // 最早到期时间的缓存,最早的定时器被取消或到期后重新计算
+  uint64_t m_nextExpire;
+  bool m_nextValid;
+
+  PostQueue m_posts;
 };
\ No newline at end of file
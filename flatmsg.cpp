@@ -0,0 +1,139 @@
+#include "flatmsg.h"
+
+FlatMsg::FlatMsg(uint32_t slots) {
+  m_slots = slots;
+  m_buf = m_inline;
+  m_cap = INLINE_SIZE;
+  Clear();
+}
+
+FlatMsg::FlatMsg(const FlatMsg &other) {
+  m_slots = other.m_slots;
+  m_buf = m_inline;
+  m_cap = INLINE_SIZE;
+  m_data = m_buf;
+  m_size = 0;
+  m_present = 0;
+  *this = other;
+}
+
+FlatMsg &FlatMsg::operator=(const FlatMsg &other) {
+  if (this == &other) {
+    return *this;
+  }
+  reserve(other.m_size);
+  memcpy(m_buf, other.m_data, other.m_size);
+  m_data = m_buf;
+  m_size = other.m_size;
+  m_present = other.m_present;
+  return *this;
+}
+
+void FlatMsg::Clear() {
+  uint32_t size = slotOffset(m_slots);
+  reserve(size);
+  memset(m_buf, 0, size);
+  memcpy(m_buf, &m_slots, sizeof(m_slots));
+  m_data = m_buf;
+  m_size = size;
+  m_present = m_slots;
+}
+
+bool FlatMsg::Wrap(const void *pdata, uint32_t size) {
+  uint32_t present = 0;
+  if (size < slotOffset(0)) {
+    return false;
+  }
+  memcpy(&present, pdata, sizeof(present));
+  if (present > (size - slotOffset(0)) / 8) {
+    return false;
+  }
+  m_data = (const char *)pdata;
+  m_size = size;
+  m_present = present;
+  return true;
+}
+
+bool FlatMsg::ParseFromArray(const void *pdata, int size) {
+  if (size < 0) {
+    return false;
+  }
+  reserve(uint32_t(size));
+  memcpy(m_buf, pdata, size_t(size));
+  if (!Wrap(m_buf, uint32_t(size))) {
+    Clear();
+    return false;
+  }
+  return true;
+}
+
+FlatStr FlatMsg::getStr(uint32_t slot) const {
+  FlatStr str = {"", 0};
+  if (slot >= m_present) {
+    return str;
+  }
+  uint32_t offset = 0;
+  uint32_t size = 0;
+  memcpy(&offset, m_data + slotOffset(slot), sizeof(offset));
+  memcpy(&size, m_data + slotOffset(slot) + 4, sizeof(size));
+  // 越界的字符串当作空串,读取端不需要先校验整个消息
+  uint32_t base = slotOffset(m_present);
+  if (offset > m_size - base || size > m_size - base - offset) {
+    return str;
+  }
+  str.Data = m_data + base + offset;
+  str.Size = size;
+  return str;
+}
+
+void FlatMsg::setStr(uint32_t slot, const char *pdata, size_t size) {
+  own();
+  uint32_t offset = m_size - slotOffset(m_present);
+  reserve(m_size + uint32_t(size));
+  memcpy(m_buf + m_size, pdata, size);
+  m_size += uint32_t(size);
+  uint32_t len = uint32_t(size);
+  memcpy(m_buf + slotOffset(slot), &offset, sizeof(offset));
+  memcpy(m_buf + slotOffset(slot) + 4, &len, sizeof(len));
+}
+
+char *FlatMsg::own() {
+  if (m_data == m_buf && m_present >= m_slots) {
+    return m_buf;
+  }
+  // Wrap之后或对端槽位较少时,复制到自己的缓冲区并把槽位补齐到本地的槽位数
+  // 字符串偏移相对变长数据区,槽位区变长不影响已有的字符串
+  uint32_t present = m_present > m_slots ? m_present : m_slots;
+  uint32_t extra = slotOffset(present) - slotOffset(m_present);
+  uint32_t total = m_size + extra;
+  std::unique_ptr<char[]> tmp(new char[total]);
+  memcpy(tmp.get(), m_data, slotOffset(m_present));
+  memset(tmp.get() + slotOffset(m_present), 0, extra);
+  memcpy(tmp.get() + slotOffset(present), m_data + slotOffset(m_present),
+         m_size - slotOffset(m_present));
+  memcpy(tmp.get(), &present, sizeof(present));
+  reserve(total);
+  memcpy(m_buf, tmp.get(), total);
+  m_data = m_buf;
+  m_size = total;
+  m_present = present;
+  return m_buf;
+}
+
+void FlatMsg::reserve(uint32_t size) {
+  if (size <= m_cap) {
+    return;
+  }
+  uint32_t cap = m_cap;
+  while (cap < size) {
+    cap <<= 1;
+  }
+  std::unique_ptr<char[]> heap(new char[cap]);
+  if (m_data == m_buf) {
+    memcpy(heap.get(), m_buf, m_size);
+    m_data = heap.get();
+  }
+  m_heap.swap(heap);
+  m_buf = m_heap.get();
+  m_cap = cap;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+
+// 字符串字段的只读视图,指向消息内部的字节
+struct FlatStr {
+  const char *Data;
+  uint32_t Size;
+  std::string ToString() const { return std::string(Data, Size); }
+};
+
+/*
+  flat格式的包体
+  |4字节|4字节|槽位...|变长数据|
+  4字节   槽位数
+  4字节   保留
+  槽位    每个8字节,按字段编号顺序排列,相对包体开头8字节对齐
+          标量按本机字节序(小端)存放,字符串存放4字节偏移和4字节长度
+  变长数据 字符串内容,偏移相对变长数据区开头
+  读取时直接访问字节,没有解析步骤;对端的槽位比本地少时缺少的字段为零值
+*/
+class FlatMsg {
+ public:
+  explicit FlatMsg(uint32_t slots);
+  FlatMsg(const FlatMsg &other);
+  FlatMsg &operator=(const FlatMsg &other);
+
+  // 与protobuf消息相同的接口,ProtoRPC/ProtoRPCServer按同样的方式收发
+  bool AppendToString(std::string *out) const {
+    out->append(m_data, m_size);
+    return true;
+  }
+  bool ParseFromArray(const void *pdata, int size);
+  bool ParseFromString(const std::string &data) {
+    return ParseFromArray(data.data(), int(data.size()));
+  }
+  // 直接引用pdata,不拷贝,调用者保证读取期间这段内存有效
+  bool Wrap(const void *pdata, uint32_t size);
+  void CopyFrom(const FlatMsg &other) { *this = other; }
+  void Clear();
+  size_t ByteSizeLong() const { return m_size; }
+
+ protected:
+  template <typename T>
+  T getScalar(uint32_t slot) const {
+    static_assert(std::is_arithmetic<T>::value && sizeof(T) <= 8,
+                  "flat scalar must fit in a slot");
+    T v = T();
+    if (slot < m_present) {
+      memcpy(&v, m_data + slotOffset(slot), sizeof(T));
+    }
+    return v;
+  }
+  template <typename T>
+  void setScalar(uint32_t slot, T v) {
+    static_assert(std::is_arithmetic<T>::value && sizeof(T) <= 8,
+                  "flat scalar must fit in a slot");
+    memcpy(own() + slotOffset(slot), &v, sizeof(T));
+  }
+  FlatStr getStr(uint32_t slot) const;
+  // 字符串追加在变长数据区,重复设置同一字段会浪费空间,需要时先Clear
+  void setStr(uint32_t slot, const char *pdata, size_t size);
+
+ private:
+  static uint32_t slotOffset(uint32_t slot) { return 8 + slot * 8; }
+  char *own();
+  void reserve(uint32_t size);
+
+ private:
+  static const uint32_t INLINE_SIZE = 256;
+  const char *m_data;
+  uint32_t m_size;
+  uint32_t m_slots;
+  uint32_t m_present;
+  char *m_buf;
+  uint32_t m_cap;
+  std::unique_ptr<char[]> m_heap;
+  alignas(8) char m_inline[INLINE_SIZE];
+};
@@ -0,0 +1,100 @@
+#include "goawait.h"
+
+#if defined(__cpp_impl_coroutine)
+
+#include <sys/socket.h>
+
+#include <cerrno>
+#include <new>
+
+namespace {
+// 按64字节分档,2KB以内的帧释放后留在本线程的空闲链表中复用
+const size_t FRAME_ALIGN = 64;
+const size_t FRAME_CLASSES = 32;
+struct FrameNode {
+  FrameNode *Next;
+};
+thread_local FrameNode *freeFrames[FRAME_CLASSES];
+thread_local size_t frameBytes;
+}  // namespace
+
+void *AllocFrame(size_t size) {
+  size_t idx = (size + FRAME_ALIGN - 1) / FRAME_ALIGN;
+  frameBytes += idx * FRAME_ALIGN;
+  if (idx == 0 || idx > FRAME_CLASSES) {
+    return ::operator new(size);
+  }
+  FrameNode *frame = freeFrames[idx - 1];
+  if (frame != nullptr) {
+    freeFrames[idx - 1] = frame->Next;
+    return frame;
+  }
+  return ::operator new(idx * FRAME_ALIGN);
+}
+
+void FreeFrame(void *p, size_t size) {
+  size_t idx = (size + FRAME_ALIGN - 1) / FRAME_ALIGN;
+  frameBytes -= idx * FRAME_ALIGN;
+  if (idx == 0 || idx > FRAME_CLASSES) {
+    ::operator delete(p);
+    return;
+  }
+  FrameNode *frame = static_cast<FrameNode *>(p);
+  frame->Next = freeFrames[idx - 1];
+  freeFrames[idx - 1] = frame;
+}
+
+size_t FrameBytes() { return frameBytes; }
+
+void GoAsync(Epoll *e, AsyncTask task) {
+  AsyncTask::Handle h = task.m_handle;
+  task.m_handle = nullptr;
+  h.promise().Detached = true;
+  AsyncTask::Post(e, h);
+}
+
+bool AsyncRead::tryRead() {
+  auto irecv = recv(m_socket.m_fd, m_buf, m_nbytes, 0);
+  if (irecv >= 0) {
+    m_nread = size_t(irecv);
+    return true;
+  }
+  int err = errno;
+  if (err == EAGAIN) {
+    return false;
+  }
+  m_err = err;
+  return true;
+}
+
+void AsyncRead::OnReady() {
+  if (!tryRead()) {
+    m_socket.m_inAsync = this;
+    return;
+  }
+  m_handle.resume();
+}
+
+bool AsyncAccept::tryAccept() {
+  int s = accept(m_socket.m_fd, nullptr, nullptr);
+  if (s != -1) {
+    m_fd = s;
+    return true;
+  }
+  int err = errno;
+  if (err == EAGAIN) {
+    return false;
+  }
+  m_err = err;
+  return true;
+}
+
+void AsyncAccept::OnReady() {
+  if (!tryAccept()) {
+    m_socket.m_inAsync = this;
+    return;
+  }
+  m_handle.resume();
+}
+
+#endif
@@ -0,0 +1,196 @@
+#pragma once
+
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <tuple>
+
+#include "wrapsocket.h"
+
+/*
+  C++20无栈协程接口,与GoContext共用同一个Epoll
+  只在socket上循环读写的连接处理不需要独立的栈,协程帧只有几百字节
+  AsyncTask handle(TcpSocket &s) {
+    auto [n, err] = co_await AsyncRead(s, buf, sizeof(buf));
+    s.Write(buf, n);  // Write不会挂起,直接调用
+  }
+  GoAsync(e, handle(s));
+  协程帧从本线程的分档缓存中分配,一个线程一个Epoll时即每个事件循环一份
+*/
+void *AllocFrame(size_t size);
+void FreeFrame(void *p, size_t size);
+// 本线程正在使用的协程帧字节数
+size_t FrameBytes();
+
+class AsyncTask {
+ public:
+  struct promise_type;
+  typedef std::coroutine_handle<promise_type> Handle;
+  // 结束时切换到等待它的协程;没有等待者并且已经GoAsync时释放自己
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    std::coroutine_handle<> await_suspend(Handle h) noexcept {
+      promise_type &p = h.promise();
+      if (p.Continuation) {
+        return p.Continuation;
+      }
+      if (p.Detached) {
+        h.destroy();
+      }
+      return std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+  struct promise_type {
+    std::coroutine_handle<> Continuation;
+    bool Detached = false;
+    AsyncTask get_return_object() {
+      return AsyncTask(Handle::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+    static void *operator new(size_t size) { return AllocFrame(size); }
+    static void operator delete(void *p, size_t size) { FreeFrame(p, size); }
+  };
+  struct Awaiter {
+    Handle H;
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+      H.promise().Continuation = caller;
+      return H;
+    }
+    void await_resume() {}
+  };
+
+  AsyncTask(AsyncTask &&other) : m_handle(other.m_handle) {
+    other.m_handle = nullptr;
+  }
+  AsyncTask(const AsyncTask &) = delete;
+  AsyncTask &operator=(const AsyncTask &) = delete;
+  ~AsyncTask() {
+    if (m_handle) {
+      m_handle.destroy();
+    }
+  }
+  // 在当前协程中执行子任务,子任务结束后继续
+  Awaiter operator co_await() { return Awaiter{m_handle}; }
+  // 放入e的运行队列,下一轮执行
+  static void Post(Epoll *e, std::coroutine_handle<> h) {
+    e->push([h]() { h.resume(); });
+  }
+
+ private:
+  friend void GoAsync(Epoll *e, AsyncTask task);
+  explicit AsyncTask(Handle h) : m_handle(h) {}
+
+ private:
+  Handle m_handle;
+};
+
+// 与Epoll::Go相同,在下一轮开始执行,结束后自动释放
+void GoAsync(Epoll *e, AsyncTask task);
+
+// co_await得到std::tuple<size_t, ErrNo>,语义同TcpSocket::Read
+class AsyncRead : private AsyncWaiter {
+ public:
+  AsyncRead(TcpSocket &socket, void *buf, size_t nbytes)
+      : m_socket(socket), m_buf(buf), m_nbytes(nbytes), m_nread(0), m_err(0) {}
+  bool await_ready() { return tryRead(); }
+  void await_suspend(std::coroutine_handle<> h) {
+    m_handle = h;
+    m_socket.m_inAsync = this;
+  }
+  std::tuple<size_t, ErrNo> await_resume() {
+    return std::make_tuple(m_nread, m_err);
+  }
+
+ private:
+  bool tryRead();
+  virtual void OnReady() override;
+
+ private:
+  TcpSocket &m_socket;
+  void *m_buf;
+  size_t m_nbytes;
+  size_t m_nread;
+  ErrNo m_err;
+  std::coroutine_handle<> m_handle;
+};
+
+// co_await得到std::tuple<int, ErrNo>,语义同AcceptSocket::Accept
+class AsyncAccept : private AsyncWaiter {
+ public:
+  explicit AsyncAccept(AcceptSocket &socket)
+      : m_socket(socket), m_fd(-1), m_err(0) {}
+  bool await_ready() { return tryAccept(); }
+  void await_suspend(std::coroutine_handle<> h) {
+    m_handle = h;
+    m_socket.m_inAsync = this;
+  }
+  std::tuple<int, ErrNo> await_resume() { return std::make_tuple(m_fd, m_err); }
+
+ private:
+  bool tryAccept();
+  virtual void OnReady() override;
+
+ private:
+  AcceptSocket &m_socket;
+  int m_fd;
+  ErrNo m_err;
+  std::coroutine_handle<> m_handle;
+};
+
+// 挂起ms毫秒
+class AsyncSleep {
+ public:
+  AsyncSleep(Epoll *e, unsigned int ms) : m_timer(e), m_epoll(e), m_ms(ms) {}
+  bool await_ready() { return m_ms == 0; }
+  void await_suspend(std::coroutine_handle<> h) {
+    Epoll *e = m_epoll;
+    m_timer.Start(m_ms, [e, h]() { AsyncTask::Post(e, h); });
+  }
+  void await_resume() {}
+
+ private:
+  GoTimer m_timer;
+  Epoll *m_epoll;
+  unsigned int m_ms;
+};
+
+/*
+  在有栈协程中执行func,结束后恢复等待的无栈协程
+  用于只提供GoContext接口的调用,比如ProtoRPC的Call:
+  co_await AsyncGo(e, [&](GoContext &ctx) {
+    std::tie(rsp, err) = client.QueryUserInfo(&ctx, req);
+  });
+  栈只在调用期间存在
+*/
+class AsyncGo {
+ public:
+  AsyncGo(Epoll *e, std::function<void(GoContext &)> func,
+          std::size_t stackSize = 64 * 1024)
+      : m_epoll(e), m_func(std::move(func)), m_stackSize(stackSize) {}
+  bool await_ready() { return false; }
+  void await_suspend(std::coroutine_handle<> h) {
+    Epoll *e = m_epoll;
+    std::function<void(GoContext &)> *func = &m_func;
+    e->Go(
+        [e, func, h](GoContext &ctx) {
+          (*func)(ctx);
+          AsyncTask::Post(e, h);
+        },
+        m_stackSize);
+  }
+  void await_resume() {}
+
+ private:
+  Epoll *m_epoll;
+  std::function<void(GoContext &)> m_func;
+  std::size_t m_stackSize;
+};
+
+#endif
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <cerrno>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "epoll.h"
+
+/*
+  带类型和缓冲的协程通道,只在所属Epoll的线程中使用
+  缓冲为N个元素的内联环形数组,N为0时发送方和接收方直接交接
+  等待的发送方和接收方各自按先后顺序排队,队列节点在等待协程的栈上
+  有接收方在等待时发送直接把值交给它,不经过缓冲
+  每条消息没有堆分配
+*/
+template <typename T, size_t N>
+class ChanRecvCase;
+template <typename T, size_t N>
+class ChanSendCase;
+
+template <typename T, size_t N>
+class Chan {
+ public:
+  explicit Chan(Epoll *e) {
+    m_epoll = e;
+    m_head = 0;
+    m_count = 0;
+    m_closed = false;
+  }
+  Chan(const Chan &) = delete;
+  Chan &operator=(const Chan &) = delete;
+  ~Chan() {
+    Close();
+    while (m_count > 0) {
+      slot(m_head)->~T();
+      m_head = (m_head + 1) % capacity();
+      --m_count;
+    }
+  }
+  // 缓冲满且没有接收方时挂起,通道已关闭返回EPIPE
+  ErrNo Send(GoContext *ctx, T v) {
+    ErrNo err = TrySend(v);
+    if (err != EAGAIN) {
+      return err;
+    }
+    Waiter w(ctx, &v);
+    m_senders.Push(&w);
+    ctx->Out();
+    return w.Done ? 0 : EPIPE;
+  }
+  // 没有数据时挂起,通道已关闭并且取完返回EPIPE
+  ErrNo Recv(GoContext *ctx, T &out) {
+    ErrNo err = TryRecv(out);
+    if (err != EAGAIN) {
+      return err;
+    }
+    Waiter w(ctx, &out);
+    m_receivers.Push(&w);
+    ctx->Out();
+    return w.Done ? 0 : EPIPE;
+  }
+  // 不挂起,需要等待时返回EAGAIN,v保持不变
+  ErrNo TrySend(T &v) {
+    if (m_closed) {
+      return EPIPE;
+    }
+    if (Waiter *r = popReady(m_receivers)) {
+      *(r->Value) = std::move(v);
+      wake(r);
+      return 0;
+    }
+    if (m_count == N) {
+      return EAGAIN;
+    }
+    new (slot((m_head + m_count) % capacity())) T(std::move(v));
+    ++m_count;
+    return 0;
+  }
+  ErrNo TryRecv(T &out) {
+    if (m_count > 0) {
+      T *p = slot(m_head);
+      out = std::move(*p);
+      p->~T();
+      m_head = (m_head + 1) % capacity();
+      --m_count;
+      // 腾出的位置给排在最前的发送方
+      if (Waiter *s = popReady(m_senders)) {
+        new (slot((m_head + m_count) % capacity())) T(std::move(*(s->Value)));
+        ++m_count;
+        wake(s);
+      }
+      return 0;
+    }
+    if (Waiter *s = popReady(m_senders)) {
+      out = std::move(*(s->Value));
+      wake(s);
+      return 0;
+    }
+    return m_closed ? EPIPE : EAGAIN;
+  }
+  // 唤醒所有等待者,之后的Send返回EPIPE,缓冲中剩余的数据仍可取出
+  void Close() {
+    m_closed = true;
+    while (Waiter *w = popReady(m_receivers)) {
+      wakeFail(w);
+    }
+    while (Waiter *w = popReady(m_senders)) {
+      wakeFail(w);
+    }
+  }
+  bool Closed() const { return m_closed; }
+  size_t Len() const { return m_count; }
+  size_t Cap() const { return N; }
+  Epoll *GetEpoll() { return m_epoll; }
+
+ private:
+  friend ChanRecvCase<T, N>;
+  friend ChanSendCase<T, N>;
+  // Sel不为空时节点属于一次Select,被取出时先争抢Selector
+  struct Waiter {
+    Waiter(GoContext *ctx, T *value, Selector *sel = nullptr, int index = 0)
+        : Prev(nullptr),
+          Next(nullptr),
+          Ctx(ctx),
+          Value(value),
+          Sel(sel),
+          Index(index),
+          Linked(false),
+          Done(false) {}
+    Waiter *Prev;
+    Waiter *Next;
+    GoContext *Ctx;
+    T *Value;
+    Selector *Sel;
+    int Index;
+    bool Linked;
+    bool Done;
+  };
+  struct WaitList {
+    WaitList() : Head(nullptr), Tail(nullptr) {}
+    void Push(Waiter *w) {
+      w->Prev = Tail;
+      w->Next = nullptr;
+      if (Tail == nullptr) {
+        Head = w;
+      } else {
+        Tail->Next = w;
+      }
+      Tail = w;
+      w->Linked = true;
+    }
+    Waiter *Pop() {
+      Waiter *w = Head;
+      if (w != nullptr) {
+        Remove(w);
+      }
+      return w;
+    }
+    void Remove(Waiter *w) {
+      if (w->Prev == nullptr) {
+        Head = w->Next;
+      } else {
+        w->Prev->Next = w->Next;
+      }
+      if (w->Next == nullptr) {
+        Tail = w->Prev;
+      } else {
+        w->Next->Prev = w->Prev;
+      }
+      w->Linked = false;
+    }
+    Waiter *Head;
+    Waiter *Tail;
+  };
+  // 取出排在最前且仍在等待的节点,所属Select已被其它源唤醒的节点直接丢弃
+  static Waiter *popReady(WaitList &list) {
+    while (Waiter *w = list.Pop()) {
+      if (w->Sel == nullptr || w->Sel->Fire(w->Index)) {
+        return w;
+      }
+    }
+    return nullptr;
+  }
+  static constexpr size_t capacity() { return N > 0 ? N : 1; }
+  T *slot(size_t idx) { return reinterpret_cast<T *>(&m_ring[idx]); }
+  // Select的节点已由Fire唤醒
+  void wake(Waiter *w) {
+    w->Done = true;
+    wakeFail(w);
+  }
+  void wakeFail(Waiter *w) {
+    if (w->Sel != nullptr) {
+      return;
+    }
+    GoContext *ctx = w->Ctx;
+    m_epoll->push([ctx]() { ctx->In(); });
+  }
+
+ private:
+  Epoll *m_epoll;
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type
+      m_ring[capacity()];
+  size_t m_head;
+  size_t m_count;
+  bool m_closed;
+  WaitList m_senders;
+  WaitList m_receivers;
+};
@@ -0,0 +1,207 @@
+#include "gocompute.h"
+
+#include <cstdio>
+#include <system_error>
+
+namespace {
+// 从公共队列一次最多取到本线程的任务数
+const size_t GRAB_BATCH = 32;
+}  // namespace
+
+bool WorkDeque::Push(ComputeTask *task) {
+  int64_t b = m_bottom.load(std::memory_order_relaxed);
+  int64_t t = m_top.load(std::memory_order_acquire);
+  if (b - t >= CAPACITY) {
+    return false;
+  }
+  m_tasks[b & (CAPACITY - 1)].store(task, std::memory_order_relaxed);
+  m_bottom.store(b + 1, std::memory_order_release);
+  return true;
+}
+
+ComputeTask *WorkDeque::Pop() {
+  int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+  m_bottom.store(b, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t t = m_top.load(std::memory_order_relaxed);
+  if (t > b) {
+    m_bottom.store(b + 1, std::memory_order_relaxed);
+    return nullptr;
+  }
+  ComputeTask *task =
+      m_tasks[b & (CAPACITY - 1)].load(std::memory_order_relaxed);
+  if (t == b) {
+    // 只剩最后一个,与窃取者竞争
+    if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed)) {
+      task = nullptr;
+    }
+    m_bottom.store(b + 1, std::memory_order_relaxed);
+  }
+  return task;
+}
+
+ComputeTask *WorkDeque::Steal() {
+  int64_t t = m_top.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t b = m_bottom.load(std::memory_order_acquire);
+  if (t >= b) {
+    return nullptr;
+  }
+  ComputeTask *task =
+      m_tasks[t & (CAPACITY - 1)].load(std::memory_order_relaxed);
+  if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed)) {
+    return nullptr;
+  }
+  return task;
+}
+
+ComputePool::ComputePool(unsigned int threads) {
+  m_threadNum = threads == 0 ? 1 : threads;
+  m_head = nullptr;
+  m_tail = nullptr;
+  m_pending = 0;
+  m_idle = 0;
+  m_stop = false;
+  m_steals = 0;
+}
+
+ComputePool::~ComputePool() {
+  {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_stop = true;
+  }
+  m_cond.notify_all();
+  for (auto &t : m_threads) {
+    t.join();
+  }
+}
+
+ErrNo ComputePool::Start() {
+  for (unsigned int i = 0; i < m_threadNum; i++) {
+    m_deques.emplace_back(new WorkDeque());
+  }
+  for (unsigned int i = 0; i < m_threadNum; i++) {
+    try {
+      m_threads.emplace_back(&ComputePool::work, this, size_t(i));
+    } catch (const std::system_error &e) {
+      fprintf(stderr, "%s:%d start compute thread failed:%s\n", __FILE__,
+              __LINE__, e.what());
+      return e.code().value();
+    }
+  }
+  return 0;
+}
+
+void ComputePool::Submit(ComputeTask *task) {
+  bool wake = false;
+  {
+    std::lock_guard<std::mutex> guard(m_lock);
+    task->Next = nullptr;
+    if (m_tail == nullptr) {
+      m_head = task;
+    } else {
+      m_tail->Next = task;
+    }
+    m_tail = task;
+    ++m_pending;
+    wake = m_idle > 0;
+  }
+  if (wake) {
+    m_cond.notify_one();
+  }
+}
+
+void ComputePool::work(size_t index) {
+  WorkDeque &local = *m_deques[index];
+  while (true) {
+    ComputeTask *task = local.Pop();
+    if (task == nullptr) {
+      task = grab(local);
+    }
+    if (task == nullptr) {
+      task = steal(index);
+    }
+    if (task != nullptr) {
+      run(task);
+      continue;
+    }
+    if (!park()) {
+      return;
+    }
+  }
+}
+
+// 取出一个任务直接执行,再按线程数均分一批放进本线程的队列供其他线程窃取
+ComputeTask *ComputePool::grab(WorkDeque &local) {
+  bool wake = false;
+  ComputeTask *first = nullptr;
+  {
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (m_head == nullptr) {
+      return nullptr;
+    }
+    size_t num = m_pending / m_threadNum + 1;
+    if (num > GRAB_BATCH) {
+      num = GRAB_BATCH;
+    }
+    for (size_t i = 0; i < num && m_head != nullptr; i++) {
+      ComputeTask *task = m_head;
+      if (i > 0 && !local.Push(task)) {
+        break;
+      }
+      m_head = task->Next;
+      if (m_head == nullptr) {
+        m_tail = nullptr;
+      }
+      --m_pending;
+      if (i == 0) {
+        first = task;
+      }
+    }
+    wake = m_idle > 0 && local.Size() > 0;
+  }
+  if (wake) {
+    m_cond.notify_one();
+  }
+  return first;
+}
+
+ComputeTask *ComputePool::steal(size_t index) {
+  for (size_t i = 1; i < m_threadNum; i++) {
+    ComputeTask *task = m_deques[(index + i) % m_threadNum]->Steal();
+    if (task != nullptr) {
+      m_steals.fetch_add(1, std::memory_order_relaxed);
+      return task;
+    }
+  }
+  return nullptr;
+}
+
+// 加锁后再确认没有任务才休眠,放任务的一方在同一把锁下检查m_idle,不会漏掉唤醒
+bool ComputePool::park() {
+  std::unique_lock<std::mutex> guard(m_lock);
+  if (m_stop) {
+    return false;
+  }
+  if (m_head != nullptr) {
+    return true;
+  }
+  for (auto &deque : m_deques) {
+    if (deque->Size() > 0) {
+      return true;
+    }
+  }
+  ++m_idle;
+  m_cond.wait(guard);
+  --m_idle;
+  return !m_stop;
+}
+
+void ComputePool::run(ComputeTask *task) {
+  task->Call(task->Func);
+  // Post之后协程可能已经恢复,task所在的栈不能再访问
+  GoContext *ctx = task->Ctx;
+  ctx->GetEpoll()->Post([ctx]() { ctx->In(); });
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "epoll.h"
+
+/*
+  计算线程池,给两次IO之间要做大量计算(解析、压缩、加解密)的协程使用
+  ComputePool pool(4);
+  pool.Start();
+  GoCompute(pool, &ctx, [&]() { out = Compress(in); });
+  协程挂起,计算在线程池中执行,结束后通过Epoll::Post回到原来的Epoll继续
+  socket的读写仍然只在所属Epoll的线程中进行
+  任务节点在挂起协程的栈上,提交和完成都不分配内存(Post的函数对象除外)
+*/
+struct ComputeTask {
+  void (*Call)(void *func);
+  void *Func;
+  GoContext *Ctx;
+  ComputeTask *Next;
+};
+
+/*
+  Chase-Lev工作窃取队列,只有所属线程Push/Pop(后进先出),其他线程Steal(先进先出)
+  容量固定,满时Push返回false
+*/
+class WorkDeque {
+ public:
+  static const int64_t CAPACITY = 256;
+  WorkDeque() : m_top(0), m_bottom(0) {}
+  WorkDeque(const WorkDeque &) = delete;
+  WorkDeque &operator=(const WorkDeque &) = delete;
+  bool Push(ComputeTask *task);
+  ComputeTask *Pop();
+  ComputeTask *Steal();
+  int64_t Size() const {
+    return m_bottom.load(std::memory_order_relaxed) -
+           m_top.load(std::memory_order_relaxed);
+  }
+
+ private:
+  alignas(64) std::atomic<int64_t> m_top;
+  alignas(64) std::atomic<int64_t> m_bottom;
+  std::atomic<ComputeTask *> m_tasks[CAPACITY];
+};
+
+/*
+  每个线程一个WorkDeque,外部提交的任务先进公共队列
+  线程从公共队列一次取一批放进自己的WorkDeque,空闲线程从其他线程的WorkDeque窃取
+  池中没有任务时线程在条件变量上休眠
+  析构前要保证没有协程还在等待计算结果
+*/
+class ComputePool {
+ public:
+  explicit ComputePool(unsigned int threads);
+  ComputePool(const ComputePool &) = delete;
+  ComputePool &operator=(const ComputePool &) = delete;
+  ~ComputePool();
+  ErrNo Start();
+  // 可以在任意线程调用,task在完成前必须一直有效
+  void Submit(ComputeTask *task);
+  // 被窃取执行的任务数
+  uint64_t Steals() const { return m_steals.load(std::memory_order_relaxed); }
+
+ private:
+  void work(size_t index);
+  ComputeTask *grab(WorkDeque &local);
+  ComputeTask *steal(size_t index);
+  bool park();
+  void run(ComputeTask *task);
+
+ private:
+  unsigned int m_threadNum;
+  std::vector<std::unique_ptr<WorkDeque>> m_deques;
+  std::vector<std::thread> m_threads;
+  std::mutex m_lock;
+  std::condition_variable m_cond;
+  ComputeTask *m_head;
+  ComputeTask *m_tail;
+  size_t m_pending;
+  unsigned int m_idle;
+  bool m_stop;
+  std::atomic<uint64_t> m_steals;
+};
+
+template <typename F>
+void GoCompute(ComputePool &pool, GoContext *ctx, F &&func) {
+  typedef typename std::remove_reference<F>::type Func;
+  ComputeTask task;
+  task.Call = [](void *f) { (*static_cast<Func *>(f))(); };
+  task.Func = const_cast<void *>(static_cast<const void *>(&func));
+  task.Ctx = ctx;
+  task.Next = nullptr;
+  pool.Submit(&task);
+  ctx->Out();
+}
@@ -0,0 +1,94 @@
+#include "gooffload.h"
+
+#include <cstdio>
+#include <system_error>
+
+OffloadPool::OffloadPool(unsigned int threads, size_t maxQueued) {
+  m_threadNum = threads == 0 ? 1 : threads;
+  m_maxQueued = maxQueued;
+  m_head = nullptr;
+  m_tail = nullptr;
+  m_stop = false;
+  m_stats = OffloadStats();
+}
+
+OffloadPool::~OffloadPool() {
+  {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_stop = true;
+  }
+  m_cond.notify_all();
+  for (auto &t : m_threads) {
+    t.join();
+  }
+}
+
+ErrNo OffloadPool::Start() {
+  for (unsigned int i = 0; i < m_threadNum; i++) {
+    try {
+      m_threads.emplace_back(&OffloadPool::work, this);
+    } catch (const std::system_error &e) {
+      fprintf(stderr, "%s:%d start offload thread failed:%s\n", __FILE__,
+              __LINE__, e.what());
+      return e.code().value();
+    }
+  }
+  return 0;
+}
+
+ErrNo OffloadPool::Submit(OffloadJob *job) {
+  {
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (m_stats.Queued >= m_maxQueued) {
+      ++m_stats.Rejected;
+      return EAGAIN;
+    }
+    job->Next = nullptr;
+    job->QueueTime = curtimeus();
+    if (m_tail == nullptr) {
+      m_head = job;
+    } else {
+      m_tail->Next = job;
+    }
+    m_tail = job;
+    if (++m_stats.Queued > m_stats.MaxQueued) {
+      m_stats.MaxQueued = m_stats.Queued;
+    }
+  }
+  m_cond.notify_one();
+  return 0;
+}
+
+OffloadStats OffloadPool::Stats() {
+  std::lock_guard<std::mutex> guard(m_lock);
+  return m_stats;
+}
+
+void OffloadPool::work() {
+  std::unique_lock<std::mutex> guard(m_lock);
+  while (true) {
+    if (m_head == nullptr) {
+      if (m_stop) {
+        return;
+      }
+      m_cond.wait(guard);
+      continue;
+    }
+    OffloadJob *job = m_head;
+    m_head = job->Next;
+    if (m_head == nullptr) {
+      m_tail = nullptr;
+    }
+    --m_stats.Queued;
+    ++m_stats.Running;
+    m_stats.QueueUs += curtimeus() - job->QueueTime;
+    guard.unlock();
+    job->Call(job->Func);
+    // Post之后协程可能已经恢复,job所在的栈不能再访问
+    GoContext *ctx = job->Ctx;
+    ctx->GetEpoll()->Post([ctx]() { ctx->In(); });
+    guard.lock();
+    --m_stats.Running;
+    ++m_stats.Completed;
+  }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "epoll.h"
+
+// OffloadPool的运行统计
+struct OffloadStats {
+  // 正在排队的任务数
+  size_t Queued;
+  // 排队任务数的最大值
+  size_t MaxQueued;
+  // 正在执行的任务数
+  size_t Running;
+  // 已经完成的任务数
+  uint64_t Completed;
+  // 队列已满被拒绝的任务数
+  uint64_t Rejected;
+  // 已完成任务的排队时间之和(微秒)
+  uint64_t QueueUs;
+};
+
+/*
+  执行阻塞调用的线程池,线程数和排队任务数都有上限
+  OffloadPool pool(4, 1024);
+  pool.Start();
+  e.SetOffloadPool(&pool);
+  ctx.Offload([&]() { err = getaddrinfo(host, nullptr, nullptr, &res); });
+  任务完成后通过Epoll::Post(eventfd)让协程回到原来的Epoll继续
+  析构前要保证没有协程还在等待
+*/
+class OffloadPool {
+ public:
+  OffloadPool(unsigned int threads, size_t maxQueued);
+  OffloadPool(const OffloadPool &) = delete;
+  OffloadPool &operator=(const OffloadPool &) = delete;
+  ~OffloadPool();
+  ErrNo Start();
+  // 可以在任意线程调用,队列已满返回EAGAIN
+  ErrNo Submit(OffloadJob *job);
+  OffloadStats Stats();
+
+ private:
+  void work();
+
+ private:
+  unsigned int m_threadNum;
+  size_t m_maxQueued;
+  std::vector<std::thread> m_threads;
+  std::mutex m_lock;
+  std::condition_variable m_cond;
+  OffloadJob *m_head;
+  OffloadJob *m_tail;
+  bool m_stop;
+  OffloadStats m_stats;
+};
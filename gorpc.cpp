@@ -1,13 +1,10 @@
 #include "gorpc.h"
 
-#include "ctogo.pb.h"
-
-void GoRPC::QueryUserInfo(GoContext *ctx, const std::string &username) {
-  QueryUserInfoReq req;
-  req.set_username(username);
-  QueryUserInfoRsp rsp;
-  ErrNo err = Call(ctx, QUERY_USER_INFO, req, rsp);
-  if (err) {
-    return;
-  }
+std::tuple<QueryUserInfoRsp *, ErrNo> GoRPC::QueryUserInfo(
+    GoContext *ctx, ArenaScope &arena, const std::string &username) {
+  auto req = arena.Create<QueryUserInfoReq>();
+  auto rsp = arena.Create<QueryUserInfoRsp>();
+  req->set_username(username);
+  ErrNo err = CallShared(ctx, QUERY_USER_INFO, username, *req, *rsp);
+  return std::make_tuple(rsp, err);
 }
\ No newline at end of file
@@ -1,8 +1,12 @@
 #pragma once
 
-#include "protorpc.h"
+#include "ctogo.rpc.h"
 
-class GoRPC : public ProtoRPC {
+class GoRPC : public CtogoRPC {
  public:
-  void QueryUserInfo(GoContext *ctx, const std::string &username);
+  using CtogoRPC::QueryUserInfo;
+  // 同一用户的并发查询合并为一次请求
+  // 请求和应答都从arena上分配,返回的应答在arena析构前有效
+  std::tuple<QueryUserInfoRsp *, ErrNo> QueryUserInfo(
+      GoContext *ctx, ArenaScope &arena, const std::string &username);
 };
\ No newline at end of file
@@ -0,0 +1,45 @@
+#include "goselect.h"
+
+#include <sys/socket.h>
+
+#include <cerrno>
+
+int doSelect(GoContext *ctx, SelectCase **cases, int num) {
+  for (int i = 0; i < num; i++) {
+    if (cases[i]->Poll()) {
+      return i;
+    }
+  }
+  // Arm期间不会有源触发,否则后面的源可能和前面已挂上的源配对
+  Selector sel(ctx);
+  for (int i = 0; i < num; i++) {
+    cases[i]->Arm(&sel, i);
+  }
+  ctx->Out();
+  int fired = sel.Fired();
+  for (int i = 0; i < num; i++) {
+    cases[i]->Disarm(i == fired);
+  }
+  return fired;
+}
+
+bool SelectReadable::Poll() {
+  if (m_socket.m_fd == -1) {
+    return true;
+  }
+  // 边沿触发下已经在缓冲区中的数据不会再通知,先看一眼
+  char c;
+  auto ipeek = recv(m_socket.m_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return ipeek >= 0 || errno != EAGAIN;
+}
+
+void SelectReadable::Arm(Selector *sel, int index) {
+  m_socket.m_inSel = sel;
+  m_socket.m_inIndex = index;
+}
+
+void SelectReadable::Disarm(bool /*fired*/) { m_socket.m_inSel = nullptr; }
+
+void SelectTimeout::Arm(Selector *sel, int index) {
+  m_timer.Start(m_ms, [sel, index]() { sel->Fire(index); });
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "gochan.h"
+#include "wrapsocket.h"
+
+/*
+  协程同时等待多个源,第一个就绪的源唤醒协程,返回它的序号
+  已经就绪的源按参数顺序优先,都没有就绪时在所有源上挂起
+  先逐个Poll,全部未就绪才逐个Arm,同一次Select的源不会互相匹配
+  唤醒后把其余的源全部注销,开销与源的个数成正比
+  int idx = Select(&ctx, SelectRecv(ch, v, &err), SelectReadable(socket),
+                   SelectTimeout(&ctx, 100));
+*/
+class SelectCase {
+ public:
+  // 已经就绪时完成操作并返回true,未就绪时没有副作用
+  virtual bool Poll() = 0;
+  // 挂到等待队列上,触发时调用sel->Fire(index)
+  virtual void Arm(Selector *sel, int index) = 0;
+  // 唤醒后调用,fired为true表示该源触发了本次唤醒
+  virtual void Disarm(bool fired) = 0;
+};
+
+int doSelect(GoContext *ctx, SelectCase **cases, int num);
+
+template <typename... Cases>
+int Select(GoContext *ctx, Cases &&... cases) {
+  SelectCase *all[] = {&cases...};
+  return doSelect(ctx, all, int(sizeof...(cases)));
+}
+
+// 从通道取出一个值,通道已关闭并且取完时err为EPIPE
+template <typename T, size_t N>
+class ChanRecvCase : public SelectCase {
+ public:
+  ChanRecvCase(Chan<T, N> &ch, T &out, ErrNo *err)
+      : m_ch(ch), m_out(out), m_err(err), m_wait(nullptr, &out) {}
+  virtual bool Poll() override {
+    ErrNo err = m_ch.TryRecv(m_out);
+    if (err != EAGAIN) {
+      setErr(err);
+      return true;
+    }
+    return false;
+  }
+  virtual void Arm(Selector *sel, int index) override {
+    m_wait = typename Chan<T, N>::Waiter(sel->Ctx(), &m_out, sel, index);
+    m_ch.m_receivers.Push(&m_wait);
+  }
+  virtual void Disarm(bool fired) override {
+    if (m_wait.Linked) {
+      m_ch.m_receivers.Remove(&m_wait);
+    }
+    if (fired) {
+      setErr(m_wait.Done ? 0 : EPIPE);
+    }
+  }
+
+ private:
+  void setErr(ErrNo err) {
+    if (m_err != nullptr) {
+      *m_err = err;
+    }
+  }
+
+ private:
+  Chan<T, N> &m_ch;
+  T &m_out;
+  ErrNo *m_err;
+  typename Chan<T, N>::Waiter m_wait;
+};
+
+// 向通道发送一个值,通道已关闭时err为EPIPE
+template <typename T, size_t N>
+class ChanSendCase : public SelectCase {
+ public:
+  ChanSendCase(Chan<T, N> &ch, T &v, ErrNo *err)
+      : m_ch(ch), m_v(v), m_err(err), m_wait(nullptr, &v) {}
+  virtual bool Poll() override {
+    ErrNo err = m_ch.TrySend(m_v);
+    if (err != EAGAIN) {
+      setErr(err);
+      return true;
+    }
+    return false;
+  }
+  virtual void Arm(Selector *sel, int index) override {
+    m_wait = typename Chan<T, N>::Waiter(sel->Ctx(), &m_v, sel, index);
+    m_ch.m_senders.Push(&m_wait);
+  }
+  virtual void Disarm(bool fired) override {
+    if (m_wait.Linked) {
+      m_ch.m_senders.Remove(&m_wait);
+    }
+    if (fired) {
+      setErr(m_wait.Done ? 0 : EPIPE);
+    }
+  }
+
+ private:
+  void setErr(ErrNo err) {
+    if (m_err != nullptr) {
+      *m_err = err;
+    }
+  }
+
+ private:
+  Chan<T, N> &m_ch;
+  T &m_v;
+  ErrNo *m_err;
+  typename Chan<T, N>::Waiter m_wait;
+};
+
+template <typename T, size_t N>
+ChanRecvCase<T, N> SelectRecv(Chan<T, N> &ch, T &out, ErrNo *err = nullptr) {
+  return ChanRecvCase<T, N>(ch, out, err);
+}
+
+template <typename T, size_t N>
+ChanSendCase<T, N> SelectSend(Chan<T, N> &ch, T &v, ErrNo *err = nullptr) {
+  return ChanSendCase<T, N>(ch, v, err);
+}
+
+// socket可读、出错或对端关闭,之后的Read不会挂起
+class SelectReadable : public SelectCase {
+ public:
+  explicit SelectReadable(TcpSocket &socket) : m_socket(socket) {}
+  virtual bool Poll() override;
+  virtual void Arm(Selector *sel, int index) override;
+  virtual void Disarm(bool fired) override;
+
+ private:
+  TcpSocket &m_socket;
+};
+
+// 超时,ms为0时立即就绪
+class SelectTimeout : public SelectCase {
+ public:
+  SelectTimeout(GoContext *ctx, unsigned int ms)
+      : m_timer(ctx->GetEpoll()), m_ms(ms) {}
+  virtual bool Poll() override { return m_ms == 0; }
+  virtual void Arm(Selector *sel, int index) override;
+  virtual void Disarm(bool /*fired*/) override { m_timer.Stop(); }
+
+ private:
+  GoTimer m_timer;
+  unsigned int m_ms;
+};
@@ -23,8 +23,9 @@ const (
 type CmdID int32
 
 const (
-	CmdID_HEART_BEAT      CmdID = 0
-	CmdID_QUERY_USER_INFO CmdID = 1
+	CmdID_HEART_BEAT           CmdID = 0
+	CmdID_QUERY_USER_INFO      CmdID = 1
+	CmdID_QUERY_USER_INFO_FLAT CmdID = 2
 )
 
 // Enum value maps for CmdID.
@@ -32,10 +33,12 @@ var (
 	CmdID_name = map[int32]string{
 		0: "HEART_BEAT",
 		1: "QUERY_USER_INFO",
+		2: "QUERY_USER_INFO_FLAT",
 	}
 	CmdID_value = map[string]int32{
-		"HEART_BEAT":      0,
-		"QUERY_USER_INFO": 1,
+		"HEART_BEAT":           0,
+		"QUERY_USER_INFO":      1,
+		"QUERY_USER_INFO_FLAT": 2,
 	}
 )
 
@@ -189,11 +192,13 @@ var file_ctogo_proto_rawDesc = []byte{
 	0x4e, 0x61, 0x6d, 0x65, 0x12, 0x1a, 0x0a, 0x08, 0x50, 0x61, 0x73, 0x73, 0x77, 0x6f, 0x72, 0x64,
 	0x18, 0x02, 0x20, 0x01, 0x28, 0x09, 0x52, 0x08, 0x50, 0x61, 0x73, 0x73, 0x77, 0x6f, 0x72, 0x64,
 	0x12, 0x14, 0x0a, 0x05, 0x4d, 0x6f, 0x6e, 0x65, 0x79, 0x18, 0x03, 0x20, 0x01, 0x28, 0x07, 0x52,
-	0x05, 0x4d, 0x6f, 0x6e, 0x65, 0x79, 0x2a, 0x2c, 0x0a, 0x05, 0x43, 0x6d, 0x64, 0x49, 0x44, 0x12,
+	0x05, 0x4d, 0x6f, 0x6e, 0x65, 0x79, 0x2a, 0x46, 0x0a, 0x05, 0x43, 0x6d, 0x64, 0x49, 0x44, 0x12,
 	0x0e, 0x0a, 0x0a, 0x48, 0x45, 0x41, 0x52, 0x54, 0x5f, 0x42, 0x45, 0x41, 0x54, 0x10, 0x00, 0x12,
 	0x13, 0x0a, 0x0f, 0x51, 0x55, 0x45, 0x52, 0x59, 0x5f, 0x55, 0x53, 0x45, 0x52, 0x5f, 0x49, 0x4e,
-	0x46, 0x4f, 0x10, 0x01, 0x42, 0x10, 0x5a, 0x0e, 0x67, 0x6f, 0x73, 0x65, 0x72, 0x76, 0x65, 0x72,
-	0x2f, 0x63, 0x74, 0x6f, 0x67, 0x6f, 0x62, 0x06, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x33,
+	0x46, 0x4f, 0x10, 0x01, 0x12, 0x18, 0x0a, 0x14, 0x51, 0x55, 0x45, 0x52, 0x59, 0x5f, 0x55, 0x53,
+	0x45, 0x52, 0x5f, 0x49, 0x4e, 0x46, 0x4f, 0x5f, 0x46, 0x4c, 0x41, 0x54, 0x10, 0x02, 0x42, 0x10,
+	0x5a, 0x0e, 0x67, 0x6f, 0x73, 0x65, 0x72, 0x76, 0x65, 0x72, 0x2f, 0x63, 0x74, 0x6f, 0x67, 0x6f,
+	0x62, 0x06, 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x33,
 }
 
 var (
@@ -14,6 +14,9 @@ import (
 
 const MSG_HEAD_LEN = 10
 
+// 包长度字段的高8位为标志位
+const MSG_FLAG_MASK = 0xFF000000
+
 func main() {
 	log.SetFlags(log.LstdFlags | log.Lshortfile)
 	os.Remove("/test.sock")
@@ -71,7 +74,7 @@ func NewConnect(c net.Conn) {
 }
 
 func parseMsgHead(data []byte, plength *uint32, pseq *uint32, pcmd *uint16) {
-	*plength = binary.BigEndian.Uint32(data)
+	*plength = binary.BigEndian.Uint32(data) &^ MSG_FLAG_MASK
 	*pseq = binary.BigEndian.Uint32(data[4:])
 	*pcmd = binary.BigEndian.Uint16(data[8:])
 }
@@ -104,6 +107,8 @@ func OnProcess(psocket tcpsocket.Ptr, data []byte) (int, error) {
 
 func OnCmd(psocket tcpsocket.Ptr, cmd uint16, seq uint32, data []byte) {
 	switch cmd {
+	case uint16(ctogo.CmdID_HEART_BEAT):
+		OnHeartBeat(psocket, cmd, seq)
 	case uint16(ctogo.CmdID_QUERY_USER_INFO):
 		OnQueryUserInfo(psocket, cmd, seq, data)
 	default:
@@ -123,6 +128,12 @@ func SendMsg(psocket tcpsocket.Ptr, cmd uint16, seq uint32, msg proto.Message) {
 	psocket.Write(msgHead[:], msgBody)
 }
 
+func OnHeartBeat(psocket tcpsocket.Ptr, cmd uint16, seq uint32) {
+	var msgHead [MSG_HEAD_LEN]byte
+	serialMsgHead(msgHead[:], uint32(len(msgHead)), seq, cmd)
+	psocket.Write(msgHead[:])
+}
+
 func OnQueryUserInfo(psocket tcpsocket.Ptr, cmd uint16, seq uint32, data []byte) {
 	var req ctogo.QueryUserInfoReq
 	if err := proto.Unmarshal(data, &req); err != nil {
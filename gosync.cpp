@@ -0,0 +1,95 @@
+#include "gosync.h"
+
+void GoWaitList::Wait(GoContext *ctx) {
+  Node node = {ctx, nullptr};
+  if (m_tail == nullptr) {
+    m_head = &node;
+  } else {
+    m_tail->Next = &node;
+  }
+  m_tail = &node;
+  ctx->Out();
+}
+
+bool GoWaitList::WakeOne() {
+  Node *node = m_head;
+  if (node == nullptr) {
+    return false;
+  }
+  m_head = node->Next;
+  if (m_head == nullptr) {
+    m_tail = nullptr;
+  }
+  GoContext *ctx = node->Ctx;
+  ctx->GetEpoll()->push([ctx]() { ctx->In(); });
+  return true;
+}
+
+void GoWaitList::WakeAll() {
+  while (WakeOne()) {
+  }
+}
+
+void WaitGroup::Done() {
+  if (--m_count <= 0) {
+    m_count = 0;
+    m_waits.WakeAll();
+  }
+}
+
+void WaitGroup::Wait(GoContext *ctx) {
+  if (m_count > 0) {
+    m_waits.Wait(ctx);
+  }
+}
+
+void Semaphore::Acquire(GoContext *ctx) {
+  if (m_count > 0) {
+    --m_count;
+    return;
+  }
+  // 被唤醒时许可已经转给了自己
+  m_waits.Wait(ctx);
+}
+
+bool Semaphore::TryAcquire() {
+  if (m_count == 0) {
+    return false;
+  }
+  --m_count;
+  return true;
+}
+
+void Semaphore::Release() {
+  if (!m_waits.WakeOne()) {
+    ++m_count;
+  }
+}
+
+void Mutex::Lock(GoContext *ctx) {
+  if (!m_locked) {
+    m_locked = true;
+    return;
+  }
+  m_waits.Wait(ctx);
+}
+
+bool Mutex::TryLock() {
+  if (m_locked) {
+    return false;
+  }
+  m_locked = true;
+  return true;
+}
+
+void Mutex::Unlock() {
+  if (!m_waits.WakeOne()) {
+    m_locked = false;
+  }
+}
+
+void CondVar::Wait(GoContext *ctx, Mutex &mu) {
+  mu.Unlock();
+  m_waits.Wait(ctx);
+  mu.Lock(ctx);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "epoll.h"
+
+/*
+  协程同步原语,只在所属Epoll的线程中使用
+  等待的协程按先后顺序排队,队列节点在等待协程的栈上,没有堆分配
+  唤醒通过Epoll的运行队列,被唤醒的协程在本轮事件处理中继续执行
+*/
+class GoWaitList {
+ public:
+  struct Node {
+    GoContext *Ctx;
+    Node *Next;
+  };
+  GoWaitList() {
+    m_head = nullptr;
+    m_tail = nullptr;
+  }
+  GoWaitList(const GoWaitList &) = delete;
+  GoWaitList &operator=(const GoWaitList &) = delete;
+  void Wait(GoContext *ctx);
+  bool WakeOne();
+  void WakeAll();
+  bool Empty() const { return m_head == nullptr; }
+
+ private:
+  Node *m_head;
+  Node *m_tail;
+};
+
+// 等待一组协程结束: Add增加计数,Done减少,计数归零时唤醒所有Wait
+class WaitGroup {
+ public:
+  WaitGroup() { m_count = 0; }
+  WaitGroup(const WaitGroup &) = delete;
+  WaitGroup &operator=(const WaitGroup &) = delete;
+  void Add(int num) { m_count += num; }
+  void Done();
+  void Wait(GoContext *ctx);
+
+ private:
+  int m_count;
+  GoWaitList m_waits;
+};
+
+// 计数信号量,释放时直接交给排在最前的等待者,后来的协程不会插队
+class Semaphore {
+ public:
+  explicit Semaphore(unsigned int count) { m_count = count; }
+  Semaphore(const Semaphore &) = delete;
+  Semaphore &operator=(const Semaphore &) = delete;
+  void Acquire(GoContext *ctx);
+  bool TryAcquire();
+  void Release();
+  unsigned int Available() const { return m_count; }
+
+ private:
+  unsigned int m_count;
+  GoWaitList m_waits;
+};
+
+// 跨越挂起点保护多步操作的互斥锁,不可重入,解锁时直接交给下一个等待者
+class Mutex {
+ public:
+  Mutex() { m_locked = false; }
+  Mutex(const Mutex &) = delete;
+  Mutex &operator=(const Mutex &) = delete;
+  void Lock(GoContext *ctx);
+  bool TryLock();
+  void Unlock();
+
+ private:
+  bool m_locked;
+  GoWaitList m_waits;
+};
+
+// 条件变量,Wait时释放mu并挂起,被唤醒后重新持有mu
+class CondVar {
+ public:
+  CondVar() {}
+  CondVar(const CondVar &) = delete;
+  CondVar &operator=(const CondVar &) = delete;
+  void Wait(GoContext *ctx, Mutex &mu);
+  void Signal() { m_waits.WakeOne(); }
+  void Broadcast() { m_waits.WakeAll(); }
+
+ private:
+  GoWaitList m_waits;
+};
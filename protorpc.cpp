@@ -1,83 +1,231 @@
 #include "protorpc.h"
 
+#include <lz4.h>
+
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
 
 /*
   消息由包头和包体组成,包头长度为固定10字节
   |4字节|4字节|2字节|包体|
-  4字节   总个包的长度
+  4字节   高8位为标志位,低24位为总个包的长度
   4字节   消息序列号
   2字节   消息id
   包体    根据消息id，对应proto文件中message序列化的字节数据
 */
 
-void ProtoRPC::parseMsgHead(void *pdata, uint32_t &length, uint32_t &seq,
-                            uint16_t &cmd) {
-  uint32_t *plength = (uint32_t *)pdata;
+void parseMsgHead(const void *pdata, uint32_t &length, uint32_t &seq,
+                  uint16_t &cmd) {
+  uint32_t flags = 0;
+  parseMsgHead(pdata, length, seq, cmd, flags);
+}
+
+void parseMsgHead(const void *pdata, uint32_t &length, uint32_t &seq,
+                  uint16_t &cmd, uint32_t &flags) {
+  const uint32_t *plength = (const uint32_t *)pdata;
   length = ntohl(*plength);
-  uint32_t *pseq = plength + 1;
+  flags = length & MSG_FLAG_MASK;
+  length &= ~MSG_FLAG_MASK;
+  const uint32_t *pseq = plength + 1;
   seq = ntohl(*pseq);
-  uint16_t *pcmd = (uint16_t *)(pseq + 1);
+  const uint16_t *pcmd = (const uint16_t *)(pseq + 1);
   cmd = ntohs(*pcmd);
 }
 
-void ProtoRPC::serialMsgHead(void *pdata, uint32_t length, uint32_t seq,
-                             uint16_t cmd) {
+void serialMsgHead(void *pdata, uint32_t length, uint32_t seq, uint16_t cmd,
+                   uint32_t flags) {
   uint32_t *plength = (uint32_t *)pdata;
-  *plength = htonl(length);
+  *plength = htonl(length | flags);
   uint32_t *pseq = plength + 1;
   *pseq = htonl(seq);
   uint16_t *pcmd = (uint16_t *)(pseq + 1);
   *pcmd = htons(cmd);
 }
 
+bool compressFrame(const void *pdata, uint32_t size, std::string &out) {
+  uint32_t length = 0;
+  uint32_t seq = 0;
+  uint16_t cmd = 0;
+  uint32_t flags = 0;
+  parseMsgHead(pdata, length, seq, cmd, flags);
+  int bodySize = int(size - MSG_HEAD_LEN);
+  const size_t headSize = MSG_HEAD_LEN + sizeof(uint32_t);
+  out.resize(headSize + size_t(LZ4_compressBound(bodySize)));
+  int n = LZ4_compress_default((const char *)pdata + MSG_HEAD_LEN,
+                               &(out[headSize]), bodySize,
+                               int(out.size() - headSize));
+  if (n <= 0 || headSize + size_t(n) >= size) {
+    return false;
+  }
+  out.resize(headSize + size_t(n));
+  serialMsgHead(&(out[0]), uint32_t(out.size()), seq, cmd,
+                flags | MSG_FLAG_LZ4);
+  uint32_t raw = htonl(uint32_t(bodySize));
+  memcpy(&(out[MSG_HEAD_LEN]), &raw, sizeof(raw));
+  return true;
+}
+
+ErrNo inflateFrame(const void *pdata, uint32_t size, std::string &out) {
+  uint32_t length = 0;
+  uint32_t seq = 0;
+  uint16_t cmd = 0;
+  uint32_t flags = 0;
+  parseMsgHead(pdata, length, seq, cmd, flags);
+  const size_t headSize = MSG_HEAD_LEN + sizeof(uint32_t);
+  if (size < headSize) {
+    return EBADMSG;
+  }
+  uint32_t raw = 0;
+  memcpy(&raw, (const char *)pdata + MSG_HEAD_LEN, sizeof(raw));
+  raw = ntohl(raw);
+  if (raw > ~MSG_FLAG_MASK - MSG_HEAD_LEN) {
+    return EBADMSG;
+  }
+  out.resize(MSG_HEAD_LEN + raw);
+  int n = LZ4_decompress_safe((const char *)pdata + headSize,
+                              &(out[MSG_HEAD_LEN]), int(size - headSize),
+                              int(raw));
+  if (n < 0 || uint32_t(n) != raw) {
+    return EBADMSG;
+  }
+  serialMsgHead(&(out[0]), uint32_t(out.size()), seq, cmd,
+                flags & ~MSG_FLAG_LZ4);
+  return 0;
+}
+
+static const size_t ARENA_BLOCK_SIZE = 64 * 1024;
+// 每个幂等cmd保留的延迟样本数,样本不足时不重发
+static const size_t IDEM_SAMPLES = 256;
+static const size_t IDEM_MIN_SAMPLES = 16;
+static const unsigned int RETRY_BASE_MS = 10;
+static const unsigned int RETRY_MAX_MS = 1000;
+
+static google::protobuf::ArenaOptions arenaOptions(char *block, size_t size) {
+  google::protobuf::ArenaOptions options;
+  options.initial_block = block;
+  options.initial_block_size = size;
+  return options;
+}
+
+ProtoRPC::ArenaSlot::ArenaSlot(size_t blockSize)
+    : Block(new char[blockSize]),
+      Arena(arenaOptions(Block.get(), blockSize)),
+      Users(0) {}
+
+ProtoRPC::ArenaScope::ArenaScope(ProtoRPC *rpc) {
+  m_rpc = rpc;
+  m_slot = rpc->acquireArena();
+}
+
+ProtoRPC::ArenaScope::~ArenaScope() { m_rpc->releaseArena(m_slot); }
+
 ProtoRPC::ProtoRPC() {
+  m_curArena = nullptr;
   m_epoll = nullptr;
-  m_psocket = nullptr;
+  m_connNum = 1;
+  m_bulkConnNum = 0;
+  m_connected = 0;
+  m_nextConn = 0;
   m_port = 0;
   m_reqSeq = 0;
+  m_shmCapacity = 0;
+  m_compressMin = 0;
+  m_heartInterval = 0;
+  m_heartMaxMiss = 3;
+  m_reconnectMs = 3000;
+  m_queuedBytes = 0;
+  m_queueRawBytes = 0;
+  m_maxInFlight = 0;
+  m_maxQueuedBytes = 0;
+  m_limitFailFast = false;
+  m_limitHead = nullptr;
+  m_limitTail = nullptr;
 }
 
-void ProtoRPC::Check(GoContext &ctx) {
+void ProtoRPC::onTimeout(const Key &key) {
+  auto iter = m_waitResp.find(key);
+  if (iter == m_waitResp.end()) {
+    return;
+  }
+  fprintf(stderr, "%s:%d wait timeout seq=%lu cmd=%lu\n", __FILE__, __LINE__,
+          (unsigned long int)(key.Seq), (unsigned long int)(key.Cmd));
+  Value v = iter->second;
+  m_queuedBytes -= v.QueuedBytes;
+  ++(v.Stats->Timeouts);
+  eraseWait(iter);
+  v.CallBack(ETIMEDOUT, nullptr, 0);
+  wakeLimit();
+}
+
+void ProtoRPC::Worker(GoContext &ctx, Conn *conn) {
   while (true) {
-    ctx.Sleep(60);
-    doCheck();
+    uint32_t gen = conn->Gen;
+    auto err = doWork(ctx, conn);
+    if (conn->HeartDead) {
+      err = ETIMEDOUT;
+      conn->HeartDead = false;
+    }
+    if (conn->Socket != nullptr) {
+      conn->Socket = nullptr;
+      --m_connected;
+    }
+    if (conn->Shm) {
+      conn->Shm->Close();
+      conn->Shm.reset();
+    }
+    conn->ShmActive = false;
+    conn->Compress = false;
+    failConn(conn, err);
+    wakeLimit();
+    // 已建立的连接断开后立即重连,连接失败或刚连上就断开则等待后重试
+    if (gen == conn->Gen || curtimems() < conn->ConnTime + m_reconnectMs) {
+      ctx.SleepMs(m_reconnectMs);
+    }
   }
 }
 
-void ProtoRPC::doCheck() {
-  if (m_psocket == nullptr) {
-    return;
+void ProtoRPC::failConn(Conn *conn, ErrNo err) {
+  // 所有连接都断开时,断线队列中的请求也一并失败
+  bool offline = m_connected == 0;
+  if (offline) {
+    clearQueue();
   }
-  time_t now = curtime();
-  std::vector<Key> willDel;
-  for (auto &&v : m_waitResp) {
-    if (now >= v.second.Time + 60) {
-      (v.second.CallBack)(ETIMEDOUT, nullptr, 0);
-      willDel.push_back(v.first);
+  std::vector<Value> failed;
+  for (auto iter = m_waitResp.begin(); iter != m_waitResp.end();) {
+    if (iter->second.C == conn || (offline && iter->second.C == nullptr)) {
+      failed.push_back(iter->second);
+      ++(iter->second.Stats->Errors);
+      iter = eraseWait(iter);
+    } else {
+      ++iter;
     }
   }
-  for (auto &&v : willDel) {
-    fprintf(stderr, "%s:%d wait timeout seq=%lu cmd=%lu\n", __FILE__, __LINE__,
-            (unsigned long int)(v.Seq), (unsigned long int)(v.Cmd));
-    m_waitResp.erase(v);
+  for (auto &v : failed) {
+    v.CallBack(err, nullptr, 0);
   }
 }
 
-void ProtoRPC::Worker(GoContext &ctx) {
+void ProtoRPC::HeartBeat(GoContext &ctx, Conn *conn, uint32_t gen) {
+  char head[MSG_HEAD_LEN];
   while (true) {
-    auto err = doWork(ctx);
-    m_psocket = nullptr;
-    m_msg.clear();
-    for (auto iter = m_waitResp.begin(); iter != m_waitResp.end(); ++iter) {
-      (iter->second.CallBack)(err, nullptr, 0);
+    ctx.SleepMs(m_heartInterval);
+    if (gen != conn->Gen || conn->Socket == nullptr) {
+      return;
+    }
+    if (curtimems() >=
+        conn->LastRecv + uint64_t(m_heartInterval) * m_heartMaxMiss) {
+      fprintf(stderr, "%s:%d heart beat timeout\n", __FILE__, __LINE__);
+      conn->HeartDead = true;
+      conn->Socket->Close();
+      return;
     }
-    m_waitResp.clear();
-    ctx.Sleep(3);
+    serialMsgHead(head, MSG_HEAD_LEN, GetNextSeq(), CMD_HEART_BEAT);
+    send(conn, head, sizeof(head));
   }
 }
-ErrNo ProtoRPC::doWork(GoContext &ctx) {
+
+ErrNo ProtoRPC::doWork(GoContext &ctx, Conn *conn) {
   TcpSocket connSocket(ctx.GetEpoll());
   ErrNo err = 0;
   if (m_unixPath.empty()) {
@@ -90,11 +238,22 @@ ErrNo ProtoRPC::doWork(GoContext &ctx) {
             int(err));
     return err;
   }
-  m_psocket = &connSocket;
-  if (!m_msg.empty()) {
-    connSocket.Write(&(m_msg[0]), m_msg.size());
-    m_msg.clear();
+  conn->Socket = &connSocket;
+  ++m_connected;
+  ++(conn->Gen);
+  conn->ConnTime = curtimems();
+  conn->LastRecv = conn->ConnTime;
+  if (m_heartInterval > 0) {
+    m_epoll->Go(std::bind(&ProtoRPC::HeartBeat, this, std::placeholders::_1,
+                          conn, conn->Gen));
+  }
+  if (!m_unixPath.empty() && m_shmCapacity > 0) {
+    offerShm(conn, connSocket);
   }
+  if (m_compressMin > 0) {
+    offerCompress(connSocket);
+  }
+  flushQueue(conn);
   char readBuffer[1024 * 1024 * 4];
   size_t readBytes = 0;
   while (true) {
@@ -122,7 +281,7 @@ ErrNo ProtoRPC::doWork(GoContext &ctx) {
       ErrNo err = 0;
       size_t proc = 0;
       std::tie(proc, err) =
-          onProcess(readBuffer + procTotal, readBytes - procTotal);
+          onProcess(conn, readBuffer + procTotal, readBytes - procTotal);
       if (err) {
         return err;
       }
@@ -138,14 +297,16 @@ ErrNo ProtoRPC::doWork(GoContext &ctx) {
   }
 }
 
-std::tuple<size_t, ErrNo> ProtoRPC::onProcess(void *pdata, size_t size) {
+std::tuple<size_t, ErrNo> ProtoRPC::onProcess(Conn *conn, void *pdata,
+                                               size_t size) {
   if (size < MSG_HEAD_LEN) {
     return std::make_tuple<size_t, ErrNo>(size_t(0), ErrNo(0));
   }
   uint32_t length = 0;
   uint32_t seq = 0;
   uint16_t cmd = 0;
-  parseMsgHead(pdata, length, seq, cmd);
+  uint32_t flags = 0;
+  parseMsgHead(pdata, length, seq, cmd, flags);
   if (length < MSG_HEAD_LEN) {
     fprintf(stderr, "%s:%d msg length(%lu) < %lu\n", __FILE__, __LINE__,
             (unsigned long int)(length), (unsigned long int)(MSG_HEAD_LEN));
@@ -154,31 +315,636 @@ std::tuple<size_t, ErrNo> ProtoRPC::onProcess(void *pdata, size_t size) {
   if (length > size) {
     return std::make_tuple<size_t, ErrNo>(size_t(0), ErrNo(0));
   }
+  conn->LastRecv = curtimems();
+  if (cmd == CMD_HEART_BEAT) {
+    return std::make_tuple<size_t, ErrNo>(size_t(length), ErrNo(0));
+  }
+  if (cmd == CMD_SHM_OFFER) {
+    if (conn->Shm) {
+      conn->ShmActive = true;
+    }
+    return std::make_tuple<size_t, ErrNo>(size_t(length), ErrNo(0));
+  }
+  if (cmd == CMD_COMPRESS_OFFER) {
+    conn->Compress = true;
+    return std::make_tuple<size_t, ErrNo>(size_t(length), ErrNo(0));
+  }
+  if (flags & MSG_FLAG_LZ4) {
+    if (auto err = inflateFrame(pdata, length, conn->Inflate)) {
+      fprintf(stderr, "%s:%d inflate seq:%lu cmd:%lu failed\n", __FILE__,
+              __LINE__, (unsigned long int)(seq), (unsigned long int)(cmd));
+      return std::make_tuple<size_t, ErrNo>(size_t(0), ErrNo(err));
+    }
+    ErrNo err = 0;
+    std::tie(std::ignore, err) =
+        onProcess(conn, &(conn->Inflate[0]), conn->Inflate.size());
+    return std::make_tuple<size_t, ErrNo>(size_t(length), ErrNo(err));
+  }
   auto iter = m_waitResp.find(Key(seq, cmd));
-  if (iter == m_waitResp.end()) {
+  if (iter == m_waitResp.end() && (flags & MSG_FLAG_STREAM)) {
+    // 放弃读取的流在对端收到通知之前仍会发来若干帧
+  } else if (iter == m_waitResp.end()) {
+    CmdStats &stats = m_stats.Cmd(cmd);
+    ++stats.Late;
+    stats.BytesIn += length;
     fprintf(stderr,
             "%s:%d nobody need this response msg length=%lu seq=%lu cmd=%lu\n",
             __FILE__, __LINE__, (unsigned long int)(length),
             (unsigned long int)(seq), (unsigned long int)(cmd));
+  } else if (iter->second.S != nullptr && (flags & MSG_FLAG_STREAM)) {
+    StreamBase *stream = iter->second.S;
+    CmdStats *stats = iter->second.Stats;
+    stats->BytesIn += length;
+    if (flags & MSG_FLAG_END) {
+      stats->Latency.Record(curtimeus() - iter->second.BeginUs);
+      eraseWait(iter);
+      wakeLimit();
+    }
+    stream->onFrame(flags, ((uint8_t *)pdata) + MSG_HEAD_LEN,
+                    length - MSG_HEAD_LEN);
   } else {
-    (iter->second.CallBack)(ErrNo(0), ((uint8_t *)pdata) + MSG_HEAD_LEN,
-                            length - MSG_HEAD_LEN);
-    m_waitResp.erase(iter);
+    Value v = iter->second;
+    v.Stats->BytesIn += length;
+    v.Stats->Latency.Record(curtimeus() - v.BeginUs);
+    // 回调可能直接切到调用协程,先删除等待项,调用协程里的新调用不会让iter失效
+    eraseWait(iter);
+    wakeLimit();
+    if (flags & MSG_FLAG_END) {
+      // 对端处理失败,包体为错误码
+      uint32_t code = 0;
+      if (length >= MSG_HEAD_LEN + sizeof(code)) {
+        memcpy(&code, (uint8_t *)pdata + MSG_HEAD_LEN, sizeof(code));
+      }
+      ErrNo err = ErrNo(ntohl(code));
+      v.CallBack(err ? err : ErrNo(EPROTO), nullptr, 0);
+    } else {
+      v.CallBack(ErrNo(0), ((uint8_t *)pdata) + MSG_HEAD_LEN,
+                 length - MSG_HEAD_LEN);
+    }
   }
   return std::make_tuple<size_t, ErrNo>(size_t(length), ErrNo(0));
 }
 
+void ProtoRPC::offerShm(Conn *conn, TcpSocket &connSocket) {
+  auto shm = std::make_shared<ShmChannel>(m_epoll);
+  int fds[3];
+  ErrNo err = shm->Create(m_shmCapacity, fds);
+  if (err) {
+    fprintf(stderr, "%s:%d create shm failed errno=%d\n", __FILE__, __LINE__,
+            int(err));
+    return;
+  }
+  char head[MSG_HEAD_LEN];
+  serialMsgHead(head, MSG_HEAD_LEN, 0, CMD_SHM_OFFER);
+  err = connSocket.WriteFds(head, sizeof(head), fds, 3);
+  if (err) {
+    fprintf(stderr, "%s:%d send shm offer failed errno=%d\n", __FILE__,
+            __LINE__, int(err));
+    return;
+  }
+  conn->Shm = shm;
+  m_epoll->Go(std::bind(&ProtoRPC::ShmReader, this, std::placeholders::_1,
+                        conn, std::move(shm)));
+}
+
+void ProtoRPC::offerCompress(TcpSocket &connSocket) {
+  char frame[MSG_HEAD_LEN + sizeof(uint32_t)];
+  serialMsgHead(frame, sizeof(frame), 0, CMD_COMPRESS_OFFER);
+  uint32_t minBytes = htonl(uint32_t(std::min<size_t>(m_compressMin,
+                                                      ~MSG_FLAG_MASK)));
+  memcpy(frame + MSG_HEAD_LEN, &minBytes, sizeof(minBytes));
+  connSocket.Write(frame, sizeof(frame));
+}
+
+void ProtoRPC::ShmReader(GoContext &ctx, Conn *conn,
+                         std::shared_ptr<ShmChannel> shm) {
+  while (true) {
+    const uint8_t *pdata = nullptr;
+    size_t size = 0;
+    ErrNo err = 0;
+    std::tie(pdata, size, err) = shm->Peek(&ctx);
+    if (err) {
+      return;
+    }
+    size_t procTotal = 0;
+    while (procTotal < size) {
+      size_t proc = 0;
+      std::tie(proc, err) =
+          onProcess(conn, (void *)(pdata + procTotal), size - procTotal);
+      if (err || proc == 0) {
+        fprintf(stderr, "%s:%d bad frame in shm ring\n", __FILE__, __LINE__);
+        shm->Close();
+        return;
+      }
+      procTotal += proc;
+    }
+    shm->Consume(procTotal);
+  }
+}
+
+void ProtoRPC::send(Conn *conn, const void *pdata, size_t size, bool bulk) {
+  if (conn->ShmActive && conn->Shm->Send(pdata, size)) {
+    return;
+  }
+  if (conn->Compress && size >= m_compressMin &&
+      compressFrame(pdata, uint32_t(size), m_deflate)) {
+    pdata = &(m_deflate[0]);
+    size = m_deflate.size();
+  }
+  if (bulk) {
+    conn->Socket->WriteBulk(pdata, size);
+  } else {
+    conn->Socket->Write(pdata, size);
+  }
+}
+
+ProtoRPC::Conn *ProtoRPC::pickConn(Conn *exclude, bool bulk) {
+  if (m_connected == 0) {
+    return nullptr;
+  }
+  Conn *other = nullptr;
+  for (size_t i = 0; i < m_conns.size(); i++) {
+    size_t idx = (m_nextConn + i) % m_conns.size();
+    Conn *conn = m_conns[idx].get();
+    if (conn->Socket == nullptr || conn == exclude) {
+      continue;
+    }
+    if (conn->Bulk == bulk) {
+      m_nextConn = (idx + 1) % m_conns.size();
+      return conn;
+    }
+    if (other == nullptr) {
+      other = conn;
+    }
+  }
+  return other;
+}
+
 void ProtoRPC::Start(Epoll *e, const char *szip, uint16_t port) {
   m_epoll = e;
   m_ip.assign(szip);
   m_port = port;
-  m_epoll->Go(std::bind(&ProtoRPC::Worker, this, std::placeholders::_1));
-  m_epoll->Go(std::bind(&ProtoRPC::Check, this, std::placeholders::_1));
+  startConns();
 }
 
 void ProtoRPC::Start(Epoll *e, const char *unixPath) {
   m_epoll = e;
   m_unixPath.assign(unixPath);
-  m_epoll->Go(std::bind(&ProtoRPC::Worker, this, std::placeholders::_1));
-  m_epoll->Go(std::bind(&ProtoRPC::Check, this, std::placeholders::_1));
+  startConns();
+}
+
+void ProtoRPC::startConns() {
+  for (unsigned int i = 0; i < m_connNum + m_bulkConnNum; i++) {
+    m_conns.emplace_back(new Conn());
+    m_conns.back()->Bulk = i >= m_connNum;
+    m_epoll->Go(std::bind(&ProtoRPC::Worker, this, std::placeholders::_1,
+                          m_conns.back().get()));
+  }
+}
+
+void ProtoRPC::SetIdempotent(uint16_t cmd, double percentile,
+                             unsigned int maxRetries) {
+  IdemPolicy &policy = m_idempotent[cmd];
+  policy.Percentile = percentile;
+  policy.MaxRetries = maxRetries;
+  policy.Next = 0;
+  policy.Count = 0;
+  policy.DelayMs = 0;
+  policy.Samples.clear();
+}
+
+ErrNo ProtoRPC::callIdempotent(GoContext *ctx, uint16_t cmd, uint32_t flags,
+                               unsigned int timeoutMs, IdemPolicy &policy,
+                               ParseFunc parse, void *arg, bool inPlace) {
+  IdemCall call(ctx->GetEpoll());
+  IdemCall *pcall = &call;
+  // 重发和重试都需要请求内容,m_buffer随时会被其它协程覆盖
+  call.Req = m_buffer;
+  call.Parse = parse;
+  call.ParseArg = arg;
+  call.Flags = flags;
+  call.Bulk = (flags & MSG_FLAG_BULK) != 0;
+  call.InPlace = inPlace;
+  GoTimer deadline(ctx->GetEpoll());
+  if (timeoutMs > 0) {
+    deadline.Start(timeoutMs, [pcall]() {
+      if (!pcall->Done) {
+        pcall->Done = true;
+        pcall->Err = ETIMEDOUT;
+        pcall->Ch.Wake();
+      }
+    });
+  }
+  unsigned int attempt = 0;
+  while (true) {
+    uint64_t begin = curtimems();
+    Conn *first = pickConn(nullptr, call.Bulk);
+    sendAttempt(pcall, cmd, first);
+    GoTimer hedge(ctx->GetEpoll());
+    if (first != nullptr && policy.DelayMs > 0 && m_conns.size() > 1) {
+      hedge.Start(policy.DelayMs, [this, pcall, cmd, first]() {
+        Conn *conn = pickConn(first, pcall->Bulk);
+        if (!pcall->Done && pcall->Pending > 0 && conn != nullptr) {
+          sendAttempt(pcall, cmd, conn);
+        }
+      });
+    }
+    pcall->Ch.Wait(ctx);
+    hedge.Stop();
+    // 取消仍在途的请求,之后到达的应答会被丢弃
+    for (unsigned int i = 0; i < call.NumSeqs; i++) {
+      auto iter = m_waitResp.find(Key(call.Seqs[i], cmd));
+      if (iter != m_waitResp.end()) {
+        m_queuedBytes -= iter->second.QueuedBytes;
+        eraseWait(iter);
+      }
+    }
+    call.NumSeqs = 0;
+    call.Pending = 0;
+    wakeLimit();
+    if (call.Done) {
+      if (call.Err == 0) {
+        recordLatency(policy, uint32_t(curtimems() - begin));
+      } else if (call.Err == ETIMEDOUT) {
+        ++(m_stats.Cmd(cmd).Timeouts);
+      }
+      return call.Err;
+    }
+    // 连接错误,请求是幂等的,退避后重试
+    if (attempt >= policy.MaxRetries) {
+      return call.Err;
+    }
+    unsigned int backoff = RETRY_BASE_MS << std::min(attempt, 16u);
+    backoff = std::min(backoff, RETRY_MAX_MS);
+    backoff = backoff / 2 + (unsigned int)(m_rand() % (backoff / 2 + 1));
+    ++attempt;
+    ctx->SleepMs(backoff);
+    if (call.Done) {
+      return call.Err;
+    }
+  }
+}
+
+void ProtoRPC::IdemCall::OnReply(void *arg, ErrNo err, void *pdata,
+                                 uint32_t size) {
+  IdemCall *pcall = (IdemCall *)arg;
+  if (pcall->Done) {
+    return;
+  }
+  --(pcall->Pending);
+  if (err) {
+    // 另一个请求仍在途,等它的结果
+    if (pcall->Pending > 0) {
+      return;
+    }
+    pcall->Err = err;
+    pcall->Ch.Wake();
+    return;
+  }
+  pcall->Err = pcall->Parse(pcall->ParseArg, pdata, size);
+  pcall->Done = true;
+  if (pcall->Err == 0 && pcall->InPlace) {
+    pcall->Ch.Resume();
+  } else {
+    pcall->Ch.Wake();
+  }
+}
+
+void ProtoRPC::sendAttempt(IdemCall *call, uint16_t cmd, Conn *conn) {
+  uint32_t seq = 0;
+  while (true) {
+    seq = GetNextSeq();
+    auto p = m_waitResp.insert(std::pair<Key, Value>(
+        Key(seq, cmd), Value(&IdemCall::OnReply, call, conn)));
+    if (p.second) {
+      trackWait(p.first->second, cmd, call->Req.size());
+      break;
+    }
+  }
+  call->Seqs[call->NumSeqs] = seq;
+  call->Conns[call->NumSeqs] = conn;
+  ++(call->NumSeqs);
+  ++(call->Pending);
+  std::string &req = call->Req;
+  serialMsgHead(&(req[0]), uint32_t(req.size()), seq, cmd, call->Flags);
+  if (conn == nullptr) {
+    enqueue(Key(seq, cmd), false, req);
+  } else {
+    send(conn, &(req[0]), req.size(), call->Bulk);
+  }
+}
+
+void ProtoRPC::recordLatency(IdemPolicy &policy, uint32_t ms) {
+  if (policy.Samples.size() < IDEM_SAMPLES) {
+    policy.Samples.push_back(ms);
+  } else {
+    policy.Samples[policy.Next] = ms;
+    policy.Next = (policy.Next + 1) % IDEM_SAMPLES;
+  }
+  ++policy.Count;
+  if (policy.Samples.size() < IDEM_MIN_SAMPLES || policy.Count % 16 != 0) {
+    return;
+  }
+  std::vector<uint32_t> samples(policy.Samples);
+  size_t k = size_t(double(samples.size()) * policy.Percentile);
+  if (k >= samples.size()) {
+    k = samples.size() - 1;
+  }
+  std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+  policy.DelayMs = std::max(samples[k], uint32_t(1));
+}
+
+void ProtoRPC::SetCacheable(uint16_t cmd, unsigned int ttlMs) {
+  if (ttlMs == 0) {
+    m_cacheTTL.erase(cmd);
+    return;
+  }
+  m_cacheTTL[cmd] = ttlMs;
+}
+
+ProtoRPC::ArenaSlot *ProtoRPC::acquireArena() {
+  // 当前Arena仍有人使用且已超出初始块,换一个空闲的Arena,避免一直无法复位
+  if (m_curArena == nullptr ||
+      (m_curArena->Users > 0 &&
+       m_curArena->Arena.SpaceUsed() > ARENA_BLOCK_SIZE)) {
+    m_curArena = nullptr;
+    for (auto &v : m_arenas) {
+      if (v->Users == 0) {
+        m_curArena = v.get();
+        break;
+      }
+    }
+    if (m_curArena == nullptr) {
+      m_arenas.emplace_back(new ArenaSlot(ARENA_BLOCK_SIZE));
+      m_curArena = m_arenas.back().get();
+    }
+  }
+  ++(m_curArena->Users);
+  return m_curArena;
+}
+
+void ProtoRPC::releaseArena(ArenaSlot *slot) {
+  --(slot->Users);
+  if (slot->Users == 0) {
+    slot->Arena.Reset();
+  }
+}
+
+ProtoRPC::StreamBase::StreamBase() {
+  m_rpc = nullptr;
+  m_seq = 0;
+  m_cmd = 0;
+  m_ch = nullptr;
+  m_consumed = 0;
+  m_active = false;
+  m_end = false;
+  m_err = 0;
+}
+
+ProtoRPC::StreamBase::~StreamBase() {
+  if (m_active) {
+    m_rpc->closeStream(*this);
+  }
+}
+
+const std::string *ProtoRPC::StreamBase::next(GoContext *ctx) {
+  while (m_frames.empty()) {
+    if (m_end) {
+      return nullptr;
+    }
+    GoChan ch(ctx->GetEpoll());
+    m_ch = &ch;
+    ch.Wait(ctx);
+    m_ch = nullptr;
+  }
+  m_cur.swap(m_frames.front());
+  m_frames.pop_front();
+  ++m_consumed;
+  if (m_active && m_consumed >= STREAM_WINDOW / 2) {
+    m_rpc->streamCredit(*this, m_consumed, 0);
+    m_consumed = 0;
+  }
+  return &m_cur;
+}
+
+void ProtoRPC::StreamBase::fail(ErrNo err) {
+  if (m_active) {
+    m_rpc->closeStream(*this);
+  }
+  m_frames.clear();
+  m_end = true;
+  m_err = err;
+}
+
+void ProtoRPC::StreamBase::onFrame(uint32_t flags, const void *pdata,
+                                   uint32_t size) {
+  if (flags & MSG_FLAG_END) {
+    m_active = false;
+    m_end = true;
+    if (size >= sizeof(uint32_t)) {
+      uint32_t err = 0;
+      memcpy(&err, pdata, sizeof(err));
+      m_err = ErrNo(ntohl(err));
+    }
+  } else {
+    m_frames.emplace_back((const char *)pdata, size);
+  }
+  if (m_ch != nullptr) {
+    m_ch->Wake();
+  }
+}
+
+void ProtoRPC::StreamBase::onReply(void *arg, ErrNo err, void *pdata,
+                                   uint32_t size) {
+  // 对端不支持流式应答时,普通应答当作只有一条消息的流
+  StreamBase *stream = (StreamBase *)arg;
+  stream->m_active = false;
+  stream->m_end = true;
+  stream->m_err = err;
+  if (!err) {
+    stream->m_frames.emplace_back((const char *)pdata, size);
+  }
+  if (stream->m_ch != nullptr) {
+    stream->m_ch->Wake();
+  }
+}
+
+ErrNo ProtoRPC::openStream(uint16_t cmd, uint32_t flags,
+                           StreamBase &stream) {
+  if (stream.m_active || stream.m_end) {
+    return EINVAL;
+  }
+  Conn *conn = pickConn(nullptr);
+  uint32_t seq = 0;
+  while (true) {
+    seq = GetNextSeq();
+    auto p = m_waitResp.insert(std::pair<Key, Value>(
+        Key(seq, cmd), Value(&StreamBase::onReply, &stream, conn)));
+    if (p.second) {
+      p.first->second.S = &stream;
+      trackWait(p.first->second, cmd, m_buffer.size());
+      break;
+    }
+  }
+  stream.m_rpc = this;
+  stream.m_seq = seq;
+  stream.m_cmd = cmd;
+  stream.m_active = true;
+  serialMsgHead(&(m_buffer[0]), uint32_t(m_buffer.size()), seq, cmd, flags);
+  if (conn == nullptr) {
+    enqueue(Key(seq, cmd), false, m_buffer);
+  } else {
+    send(conn, &(m_buffer[0]), m_buffer.size());
+  }
+  return 0;
+}
+
+void ProtoRPC::closeStream(StreamBase &stream) {
+  streamCredit(stream, 0, MSG_FLAG_END);
+  auto iter = m_waitResp.find(Key(stream.m_seq, stream.m_cmd));
+  if (iter != m_waitResp.end()) {
+    m_queuedBytes -= iter->second.QueuedBytes;
+    eraseWait(iter);
+    wakeLimit();
+  }
+  stream.m_active = false;
+}
+
+void ProtoRPC::streamCredit(StreamBase &stream, uint32_t credit,
+                            uint32_t flags) {
+  auto iter = m_waitResp.find(Key(stream.m_seq, stream.m_cmd));
+  if (iter == m_waitResp.end() || iter->second.C == nullptr) {
+    return;
+  }
+  char frame[MSG_HEAD_LEN + sizeof(uint32_t)];
+  serialMsgHead(frame, sizeof(frame), stream.m_seq, CMD_STREAM_CREDIT, flags);
+  credit = htonl(credit);
+  memcpy(frame + MSG_HEAD_LEN, &credit, sizeof(credit));
+  send(iter->second.C, frame, sizeof(frame));
+}
+
+void ProtoRPC::trackWait(Value &v, uint16_t cmd, size_t bytes) {
+  CmdStats &stats = m_stats.Cmd(cmd);
+  ++stats.Requests;
+  stats.BytesOut += bytes;
+  ++stats.InFlight;
+  v.Stats = &stats;
+  v.BeginUs = curtimeus();
+}
+
+ProtoRPC::WaitMap::iterator ProtoRPC::eraseWait(WaitMap::iterator iter) {
+  --(iter->second.Stats->InFlight);
+  return m_waitResp.erase(iter);
+}
+
+void ProtoRPC::enqueue(const Key &key, bool oneway, const std::string &data) {
+  // 超时的请求已从m_waitResp删除,积累过多时把它们从队列里清掉
+  if (m_queueRawBytes > m_queuedBytes * 2 + 1024 * 1024) {
+    std::deque<QueuedMsg> live;
+    m_queueRawBytes = 0;
+    for (auto &v : m_queue) {
+      if (v.OneWay || m_waitResp.find(v.K) != m_waitResp.end()) {
+        m_queueRawBytes += v.Data.size();
+        live.push_back(std::move(v));
+      }
+    }
+    m_queue.swap(live);
+  }
+  m_queue.emplace_back(key, oneway, data);
+  m_queuedBytes += data.size();
+  m_queueRawBytes += data.size();
+  if (!oneway) {
+    m_waitResp.find(key)->second.QueuedBytes = data.size();
+  }
+}
+
+void ProtoRPC::flushQueue(Conn *conn) {
+  if (m_queue.empty()) {
+    return;
+  }
+  std::string msg;
+  for (auto &v : m_queue) {
+    if (v.OneWay) {
+      msg.append(v.Data);
+      continue;
+    }
+    auto iter = m_waitResp.find(v.K);
+    if (iter == m_waitResp.end()) {
+      continue;
+    }
+    iter->second.QueuedBytes = 0;
+    iter->second.C = conn;
+    msg.append(v.Data);
+  }
+  clearQueue();
+  if (!msg.empty()) {
+    conn->Socket->Write(&(msg[0]), msg.size());
+  }
+  wakeLimit();
+}
+
+void ProtoRPC::clearQueue() {
+  m_queue.clear();
+  m_queuedBytes = 0;
+  m_queueRawBytes = 0;
+}
+
+ErrNo ProtoRPC::overLimit(size_t bytes, bool oneway) {
+  if (!oneway && m_maxInFlight > 0 && m_waitResp.size() >= m_maxInFlight) {
+    return EBUSY;
+  }
+  if (m_connected == 0 && m_maxQueuedBytes > 0 &&
+      m_queuedBytes + bytes > m_maxQueuedBytes) {
+    return ENOBUFS;
+  }
+  return 0;
+}
+
+ErrNo ProtoRPC::waitLimit(GoContext *ctx, size_t bytes, bool oneway,
+                          unsigned int timeoutMs) {
+  if (m_limitFailFast) {
+    return overLimit(bytes, oneway);
+  }
+  LimitWaiter waiter(ctx->GetEpoll());
+  waiter.Prev = m_limitTail;
+  if (m_limitTail != nullptr) {
+    m_limitTail->Next = &waiter;
+  } else {
+    m_limitHead = &waiter;
+  }
+  m_limitTail = &waiter;
+  GoTimer timer(ctx->GetEpoll());
+  if (timeoutMs > 0) {
+    LimitWaiter *pwaiter = &waiter;
+    timer.Start(timeoutMs, [pwaiter]() {
+      pwaiter->TimedOut = true;
+      pwaiter->Ch.Wake();
+    });
+  }
+  ErrNo err = 0;
+  while (m_limitHead != &waiter || overLimit(bytes, oneway) != 0) {
+    waiter.Ch.Wait(ctx);
+    if (waiter.TimedOut) {
+      err = ETIMEDOUT;
+      break;
+    }
+  }
+  if (waiter.Prev != nullptr) {
+    waiter.Prev->Next = waiter.Next;
+  } else {
+    m_limitHead = waiter.Next;
+  }
+  if (waiter.Next != nullptr) {
+    waiter.Next->Prev = waiter.Prev;
+  } else {
+    m_limitTail = waiter.Prev;
+  }
+  wakeLimit();
+  return err;
+}
+
+void ProtoRPC::wakeLimit() {
+  if (m_limitHead != nullptr) {
+    m_limitHead->Ch.Wake();
+  }
 }
@@ -1,10 +1,148 @@
 #pragma once
 
+#include <google/protobuf/arena.h>
+
+#include <deque>
+#include <memory>
+#include <random>
 #include <unordered_map>
 
+#include "flatmsg.h"
+#include "respcache.h"
+#include "rpcstats.h"
+#include "shmring.h"
 #include "wrapsocket.h"
 
+const unsigned int MSG_HEAD_LEN = 10;
+const unsigned int CALL_TIMEOUT_MS = 60000;
+// 心跳包只有包头,对端原样返回,与ctogo.proto中的HEART_BEAT一致
+const uint16_t CMD_HEART_BEAT = 0;
+// 保留的cmd: 协商共享内存通道,请求携带memfd与门铃描述符,应答为空包
+const uint16_t CMD_SHM_OFFER = 0xFFFF;
+// 保留的cmd: 流式应答的额度,seq为流的seq,包体为4字节的帧数
+// 带MSG_FLAG_END时表示读取端放弃了这个流
+const uint16_t CMD_STREAM_CREDIT = 0xFFFE;
+// 保留的cmd: 协商lz4压缩,请求包体为4字节的压缩阈值,应答为空包
+// 收到应答后才压缩发出的包,收到的压缩包总是可以解压
+const uint16_t CMD_COMPRESS_OFFER = 0xFFFD;
+// 包长度字段的高8位用作标志位,包长度不超过16M
+const uint32_t MSG_FLAG_MASK = 0xFF000000;
+// 流式应答中的一帧,同一个流的所有帧使用请求的seq和cmd
+const uint32_t MSG_FLAG_STREAM = 0x80000000;
+// 流的最后一帧,包体为4字节错误码
+// 不带MSG_FLAG_STREAM时为普通调用的错误应答,包体同样为4字节错误码
+const uint32_t MSG_FLAG_END = 0x40000000;
+// 包体为flat格式,见flatmsg.h
+const uint32_t MSG_FLAG_FLAT = 0x20000000;
+// 包体经过lz4压缩,包体为|4字节原始包体长度|lz4数据|
+const uint32_t MSG_FLAG_LZ4 = 0x10000000;
+// 批量请求,对端把应答写入低优先级的发送队列
+const uint32_t MSG_FLAG_BULK = 0x08000000;
+// 流的初始额度,读取端每消费一半窗口归还一次额度
+const unsigned int STREAM_WINDOW = 32;
+void serialMsgHead(void *pdata, uint32_t length, uint32_t seq, uint16_t cmd,
+                   uint32_t flags = 0);
+void parseMsgHead(const void *pdata, uint32_t &length, uint32_t &seq,
+                  uint16_t &cmd);
+void parseMsgHead(const void *pdata, uint32_t &length, uint32_t &seq,
+                  uint16_t &cmd, uint32_t &flags);
+// 把完整的一帧压缩到out(覆盖原内容),压缩后没有变小时返回false
+bool compressFrame(const void *pdata, uint32_t size, std::string &out);
+// 解压带MSG_FLAG_LZ4的一帧,out为去掉该标志位的完整帧
+ErrNo inflateFrame(const void *pdata, uint32_t size, std::string &out);
+// 调用的优先级,交互请求先于批量请求写出
+// 设置了SetBulkConnections时批量请求走单独的连接,否则同一连接上排在交互请求之后
+enum CallPriority { PRIORITY_INTERACTIVE = 0, PRIORITY_BULK = 1 };
+// 消息类型对应的包头标志位,按cmd选择的编码由消息类型决定
+template <typename T>
+uint32_t msgFlags() {
+  return std::is_base_of<FlatMsg, T>::value ? MSG_FLAG_FLAT : 0;
+}
+// 解析包体,flat消息直接引用pdata不拷贝,pdata需要在msg使用期间有效
+template <typename T>
+bool parseMsgBody(T &msg, const void *pdata, uint32_t size, std::true_type) {
+  return msg.Wrap(pdata, size);
+}
+template <typename T>
+bool parseMsgBody(T &msg, const void *pdata, uint32_t size, std::false_type) {
+  return msg.ParseFromArray(pdata, int(size));
+}
+template <typename T>
+bool parseMsgBody(T &msg, const void *pdata, uint32_t size) {
+  return parseMsgBody(msg, pdata, size, std::is_base_of<FlatMsg, T>());
+}
+
 class ProtoRPC {
+  struct ArenaSlot;
+
+ public:
+  // 消息从本Loop复用的Arena上分配,最后一个使用者结束时Arena复位
+  class ArenaScope {
+   public:
+    ArenaScope(ProtoRPC *rpc);
+    ArenaScope(const ArenaScope &) = delete;
+    ArenaScope &operator=(const ArenaScope &) = delete;
+    ~ArenaScope();
+    template <typename T>
+    T *Create() {
+      return google::protobuf::Arena::CreateMessage<T>(&(m_slot->Arena));
+    }
+
+   private:
+    ProtoRPC *m_rpc;
+    ArenaSlot *m_slot;
+  };
+
+  class StreamBase {
+   public:
+    StreamBase();
+    StreamBase(const StreamBase &) = delete;
+    StreamBase &operator=(const StreamBase &) = delete;
+    // 流未读完就析构时通知对端停止发送
+    ~StreamBase();
+    // 流正常结束时为0
+    ErrNo Err() const { return m_err; }
+
+   protected:
+    const std::string *next(GoContext *ctx);
+    void fail(ErrNo err);
+
+   private:
+    friend class ProtoRPC;
+    void onFrame(uint32_t flags, const void *pdata, uint32_t size);
+    static void onReply(void *arg, ErrNo err, void *pdata, uint32_t size);
+
+   private:
+    ProtoRPC *m_rpc;
+    uint32_t m_seq;
+    uint16_t m_cmd;
+    std::deque<std::string> m_frames;
+    std::string m_cur;
+    GoChan *m_ch;
+    unsigned int m_consumed;
+    bool m_active;
+    bool m_end;
+    ErrNo m_err;
+  };
+  // 服务端流式应答的读取端,内存占用受STREAM_WINDOW限制
+  template <typename Rsp>
+  class Stream : public StreamBase {
+   public:
+    // 读取下一条消息,流结束或出错时返回false,错误由Err给出
+    bool Next(GoContext *ctx, Rsp &msg) {
+      const std::string *frame = next(ctx);
+      if (frame == nullptr) {
+        return false;
+      }
+      if (!msg.ParseFromString(*frame)) {
+        fprintf(stderr, "%s:%d ParseFromString failed\n", __FILE__, __LINE__);
+        fail(EBADMSG);
+        return false;
+      }
+      return true;
+    }
+  };
+
  public:
   ProtoRPC();
   ProtoRPC(const ProtoRPC &) = delete;
@@ -12,81 +150,290 @@ class ProtoRPC {
 
   void Start(Epoll *e, const char *szip, uint16_t port);
   void Start(Epoll *e, const char *unixPath);
+  // 连接池大小,需在Start之前设置,默认1条
+  void SetConnections(unsigned int num) { m_connNum = num > 0 ? num : 1; }
+  // 批量请求专用的连接数,需在Start之前设置,默认0条
+  // 批量连接都断开时批量请求使用普通连接,反之亦然
+  void SetBulkConnections(unsigned int num) { m_bulkConnNum = num; }
+  // 标记cmd为幂等: 超过该cmd延迟的percentile分位仍未应答时在另一条连接上
+  // 重发一次,先到的应答生效;连接出错时按带抖动的退避重试maxRetries次
+  void SetIdempotent(uint16_t cmd, double percentile, unsigned int maxRetries);
+  // 标记cmd可缓存,相同请求在ttlMs内直接返回缓存的应答
+  void SetCacheable(uint16_t cmd, unsigned int ttlMs);
+  void SetCacheBudget(size_t bytes) { m_cache.SetBudget(bytes); }
+  // 使用unix socket时尝试与对端协商共享内存通道,对端不支持则继续使用socket
+  void EnableShm(size_t capacity) { m_shmCapacity = capacity; }
+  // 每intervalMs发送一次心跳,连续maxMiss个间隔收不到任何数据则断开重连
+  void SetHeartBeat(unsigned int intervalMs, unsigned int maxMiss) {
+    m_heartInterval = intervalMs;
+    m_heartMaxMiss = maxMiss;
+  }
+  void SetReconnect(unsigned int ms) { m_reconnectMs = ms; }
+  // 与对端协商lz4压缩,双方都只压缩不小于minBytes的包,小包不受影响
+  // 共享内存通道上的包不压缩
+  void EnableCompress(size_t minBytes) { m_compressMin = minBytes; }
+  // 限制未完成的调用数与断线时排队的字节数(0为不限制)
+  // 超出限制时调用者按FIFO顺序挂起,failFast为true则直接返回EBUSY/ENOBUFS
+  void SetLimit(unsigned int maxInFlight, size_t maxQueuedBytes,
+                bool failFast = false) {
+    m_maxInFlight = maxInFlight;
+    m_maxQueuedBytes = maxQueuedBytes;
+    m_limitFailFast = failFast;
+  }
+  const RespCache &GetCache() const { return m_cache; }
+  // 按cmd的延迟直方图与计数,只能在所属Epoll的线程中读取
+  const RpcStats &GetStats() const { return m_stats; }
+  void ResetStats() { m_stats.Reset(); }
 
  protected:
   template <typename T>
-  void Call(GoContext *ctx, uint16_t cmd, const T &req) {
+  void Call(GoContext *ctx, uint16_t cmd, const T &req,
+            CallPriority priority = PRIORITY_INTERACTIVE) {
     m_buffer.resize(MSG_HEAD_LEN);
     if (!req.AppendToString(&m_buffer)) {
       fprintf(stderr, "%s:%d cmd:%lu AppendToString failed\n", __FILE__,
               __LINE__, (unsigned long int)cmd);
       return;
     }
+    CmdStats &stats = m_stats.Cmd(cmd);
+    ++stats.Requests;
+    stats.BytesOut += m_buffer.size();
+    if (limited(m_buffer.size(), true)) {
+      std::string saved(m_buffer);
+      ErrNo err = waitLimit(ctx, saved.size(), true, 0);
+      if (err) {
+        fprintf(stderr, "%s:%d cmd:%lu drop msg errno=%d\n", __FILE__,
+                __LINE__, (unsigned long int)cmd, int(err));
+        return;
+      }
+      m_buffer.swap(saved);
+    }
     uint32_t seq = GetNextSeq();
-    serialMsgHead(&(m_buffer[0]), uint32_t(m_buffer.size()), seq, cmd);
-    if (m_psocket == nullptr) {
-      m_msg.append(m_buffer);
+    bool bulk = priority == PRIORITY_BULK;
+    serialMsgHead(&(m_buffer[0]), uint32_t(m_buffer.size()), seq, cmd,
+                  msgFlags<T>() | (bulk ? MSG_FLAG_BULK : 0));
+    Conn *conn = pickConn(nullptr, bulk);
+    if (conn == nullptr) {
+      enqueue(Key(seq, cmd), true, m_buffer);
       return;
     }
-    m_psocket->Write(&(m_buffer[0]), m_buffer.size());
+    send(conn, &(m_buffer[0]), m_buffer.size(), bulk);
   }
+  // Rsp为flat消息时不拷贝,直接引用收到的字节或缓存中的应答
+  // 只在Call返回后到本协程下一次挂起或下一次Call之前有效,要保留就CopyFrom
   template <typename Req, typename Rsp>
-  ErrNo Call(GoContext *ctx, uint16_t cmd, const Req &req, Rsp &rsp) {
+  ErrNo Call(GoContext *ctx, uint16_t cmd, const Req &req, Rsp &rsp,
+             unsigned int timeoutMs = CALL_TIMEOUT_MS,
+             CallPriority priority = PRIORITY_INTERACTIVE) {
     m_buffer.resize(MSG_HEAD_LEN);
     if (!req.AppendToString(&m_buffer)) {
       fprintf(stderr, "%s:%d cmd:%lu AppendToString failed\n", __FILE__,
               __LINE__, (unsigned long int)cmd);
       return EBADMSG;
     }
+    std::string cacheKey;
+    unsigned int cacheTTL = 0;
+    auto ttlIter = m_cacheTTL.find(cmd);
+    if (ttlIter != m_cacheTTL.end()) {
+      cacheTTL = ttlIter->second;
+      cacheKey.assign((const char *)&cmd, sizeof(cmd));
+      cacheKey.append(m_buffer, MSG_HEAD_LEN, std::string::npos);
+      auto pval = m_cache.Get(cacheKey, curtimems());
+      if (pval != nullptr) {
+        if (!parseMsgBody(rsp, pval->data(), uint32_t(pval->size()))) {
+          fprintf(stderr, "%s:%d cmd:%lu parse failed\n", __FILE__, __LINE__,
+                  (unsigned long int)cmd);
+          return EBADMSG;
+        }
+        return 0;
+      }
+    }
+    if (limited(m_buffer.size(), false)) {
+      // 挂起期间m_buffer会被其它协程覆盖,先保存
+      std::string saved(m_buffer);
+      uint64_t begin = curtimems();
+      ErrNo err = waitLimit(ctx, saved.size(), false, timeoutMs);
+      if (err) {
+        return err;
+      }
+      if (timeoutMs > 0) {
+        uint64_t used = curtimems() - begin;
+        timeoutMs = used < timeoutMs ? timeoutMs - (unsigned int)(used) : 1;
+      }
+      m_buffer.swap(saved);
+    }
+    // 回调为函数指针加参数,不经过std::function
+    struct CallState {
+      ProtoRPC *Self;
+      GoChan *Ch;
+      Rsp *R;
+      ErrNo Err;
+      std::string *CacheKey;
+      unsigned int CacheTTL;
+      uint16_t Cmd;
+      static ErrNo Parse(void *arg, void *pdata, uint32_t size) {
+        CallState *pstate = (CallState *)arg;
+        if (!parseMsgBody(*(pstate->R), pdata, size)) {
+          fprintf(stderr, "%s:%d cmd:%lu parse failed\n", __FILE__, __LINE__,
+                  (unsigned long int)(pstate->Cmd));
+          return EBADMSG;
+        }
+        if (pstate->CacheTTL > 0) {
+          pstate->Self->m_cache.Put(*(pstate->CacheKey), pdata, size,
+                                    curtimems() + pstate->CacheTTL);
+        }
+        return 0;
+      }
+      static void OnReply(void *arg, ErrNo err, void *pdata, uint32_t size) {
+        CallState *pstate = (CallState *)arg;
+        pstate->Err = err ? err : Parse(arg, pdata, size);
+        // flat应答引用着收到的数据,趁数据有效直接切回调用协程
+        if (pstate->Err == 0 && std::is_base_of<FlatMsg, Rsp>::value) {
+          pstate->Ch->Resume();
+        } else {
+          pstate->Ch->Wake();
+        }
+      }
+    };
     GoChan ch(ctx->GetEpoll());
-    ErrNo retErr = 0;
-    std::function<void(ErrNo, void *, uint32_t)> cb =
-        [cmd, &ch, &rsp, &retErr](ErrNo err, void *pdata, uint32_t size) {
-          if (err) {
-            retErr = err;
-            ch.Wake();
-            return;
-          }
-          if (!rsp.ParseFromArray(pdata, int(size))) {
-            fprintf(stderr, "%s:%d cmd:%lu ParseFromArray failed\n", __FILE__,
-                    __LINE__, (unsigned long int)cmd);
-            retErr = EBADMSG;
-            ch.Wake();
-            return;
-          }
-          retErr = 0;
-          ch.Wake();
-        };
-    time_t now = curtime();
+    CallState state = {this, &ch, &rsp, 0, &cacheKey, cacheTTL, cmd};
+    bool bulk = priority == PRIORITY_BULK;
+    uint32_t flags = msgFlags<Req>() | (bulk ? MSG_FLAG_BULK : 0);
+    auto policyIter = m_idempotent.find(cmd);
+    if (policyIter != m_idempotent.end()) {
+      return callIdempotent(ctx, cmd, flags, timeoutMs, policyIter->second,
+                            &CallState::Parse, &state,
+                            std::is_base_of<FlatMsg, Rsp>::value);
+    }
+    Conn *conn = pickConn(nullptr, bulk);
     uint32_t seq = 0;
     while (true) {
       seq = GetNextSeq();
       auto p = m_waitResp.insert(
-          std::pair<Key, Value>(Key(seq, cmd), Value(cb, now)));
+          std::pair<Key, Value>(Key(seq, cmd),
+                                Value(&CallState::OnReply, &state, conn)));
       if (p.second) {
+        trackWait(p.first->second, cmd, m_buffer.size());
         break;
       }
     }
-    serialMsgHead(&(m_buffer[0]), uint32_t(m_buffer.size()), seq, cmd);
-    if (m_psocket == nullptr) {
-      m_msg.append(m_buffer);
+    GoTimer timer(ctx->GetEpoll());
+    if (timeoutMs > 0) {
+      timer.Start(timeoutMs, [this, seq, cmd]() { onTimeout(Key(seq, cmd)); });
+    }
+    serialMsgHead(&(m_buffer[0]), uint32_t(m_buffer.size()), seq, cmd, flags);
+    if (conn == nullptr) {
+      enqueue(Key(seq, cmd), false, m_buffer);
     } else {
-      m_psocket->Write(&(m_buffer[0]), m_buffer.size());
+      send(conn, &(m_buffer[0]), m_buffer.size(), bulk);
     }
     ch.Wait(ctx);
-    return retErr;
+    return state.Err;
+  }
+  // 发起流式调用,应答通过stream.Next逐条读取,stream在读完前不能移动
+  template <typename Req, typename Rsp>
+  ErrNo OpenStream(GoContext *ctx, uint16_t cmd, const Req &req,
+                   Stream<Rsp> &stream) {
+    m_buffer.resize(MSG_HEAD_LEN);
+    if (!req.AppendToString(&m_buffer)) {
+      fprintf(stderr, "%s:%d cmd:%lu AppendToString failed\n", __FILE__,
+              __LINE__, (unsigned long int)cmd);
+      return EBADMSG;
+    }
+    if (limited(m_buffer.size(), false)) {
+      std::string saved(m_buffer);
+      ErrNo err = waitLimit(ctx, saved.size(), false, 0);
+      if (err) {
+        return err;
+      }
+      m_buffer.swap(saved);
+    }
+    return openStream(cmd, msgFlags<Req>(), stream);
+  }
+  // 相同(cmd, 请求字节)的并发调用合并为一次请求,所有调用者共享同一个应答
+  template <typename Req, typename Rsp>
+  ErrNo CallShared(GoContext *ctx, uint16_t cmd, const Req &req, Rsp &rsp,
+                   unsigned int timeoutMs = CALL_TIMEOUT_MS) {
+    std::string key;
+    if (!req.AppendToString(&key)) {
+      fprintf(stderr, "%s:%d cmd:%lu AppendToString failed\n", __FILE__,
+              __LINE__, (unsigned long int)cmd);
+      return EBADMSG;
+    }
+    return CallShared(ctx, cmd, key, req, rsp, timeoutMs);
+  }
+  // 由调用者提供合并用的key(比如用户名),省去序列化请求
+  template <typename Req, typename Rsp>
+  ErrNo CallShared(GoContext *ctx, uint16_t cmd, const std::string &key,
+                   const Req &req, Rsp &rsp,
+                   unsigned int timeoutMs = CALL_TIMEOUT_MS) {
+    std::string flightKey((const char *)&cmd, sizeof(cmd));
+    flightKey.append(key);
+    auto iter = m_flights.find(flightKey);
+    if (iter != m_flights.end()) {
+      GoChan ch(ctx->GetEpoll());
+      FlightWaiter waiter(&ch, &rsp);
+      iter->second->push_back(&waiter);
+      ch.Wait(ctx);
+      return waiter.Err;
+    }
+    std::vector<FlightWaiter *> waiters;
+    m_flights.insert(std::make_pair(flightKey, &waiters));
+    ErrNo err = Call(ctx, cmd, req, rsp, timeoutMs);
+    m_flights.erase(flightKey);
+    for (auto v : waiters) {
+      v->Err = err;
+      if (!err) {
+        static_cast<Rsp *>(v->Rsp)->CopyFrom(rsp);
+      }
+      v->Ch->Wake();
+    }
+    return err;
   }
 
  private:
-  void Worker(GoContext &ctx);
-  void Check(GoContext &ctx);
-  ErrNo doWork(GoContext &ctx);
-  void doCheck();
-  std::tuple<size_t, ErrNo> onProcess(void *pdata, size_t size);
+  // 应答回调,arg为发起调用时登记的参数
+  typedef void (*ReplyFunc)(void *arg, ErrNo err, void *pdata, uint32_t size);
+  typedef ErrNo (*ParseFunc)(void *arg, void *pdata, uint32_t size);
+  struct Key;
+  struct Conn;
+  struct IdemPolicy;
+  struct IdemCall;
+  void Worker(GoContext &ctx, Conn *conn);
+  void ShmReader(GoContext &ctx, Conn *conn, std::shared_ptr<ShmChannel> shm);
+  void HeartBeat(GoContext &ctx, Conn *conn, uint32_t gen);
+  ErrNo doWork(GoContext &ctx, Conn *conn);
+  void offerShm(Conn *conn, TcpSocket &connSocket);
+  void offerCompress(TcpSocket &connSocket);
+  void startConns();
+  void send(Conn *conn, const void *pdata, size_t size, bool bulk = false);
+  // 优先选择与bulk同类的连接
+  Conn *pickConn(Conn *exclude, bool bulk = false);
+  void failConn(Conn *conn, ErrNo err);
+  // inPlace为true时应答在收到它的协程里直接交给调用者,见Call
+  ErrNo callIdempotent(GoContext *ctx, uint16_t cmd, uint32_t flags,
+                       unsigned int timeoutMs, IdemPolicy &policy,
+                       ParseFunc parse, void *arg, bool inPlace);
+  void sendAttempt(IdemCall *call, uint16_t cmd, Conn *conn);
+  void recordLatency(IdemPolicy &policy, uint32_t ms);
+  ErrNo openStream(uint16_t cmd, uint32_t flags, StreamBase &stream);
+  void closeStream(StreamBase &stream);
+  void streamCredit(StreamBase &stream, uint32_t credit, uint32_t flags);
+  void enqueue(const Key &key, bool oneway, const std::string &data);
+  void flushQueue(Conn *conn);
+  void clearQueue();
+  ErrNo overLimit(size_t bytes, bool oneway);
+  bool limited(size_t bytes, bool oneway) {
+    return m_limitHead != nullptr || overLimit(bytes, oneway) != 0;
+  }
+  ErrNo waitLimit(GoContext *ctx, size_t bytes, bool oneway,
+                  unsigned int timeoutMs);
+  void wakeLimit();
+  void onTimeout(const Key &key);
+  std::tuple<size_t, ErrNo> onProcess(Conn *conn, void *pdata, size_t size);
   uint32_t GetNextSeq() { return ++m_reqSeq; }
-  void serialMsgHead(void *pdata, uint32_t length, uint32_t seq, uint16_t cmd);
-  void parseMsgHead(void *pdata, uint32_t &length, uint32_t &seq,
-                    uint16_t &cmd);
+  ArenaSlot *acquireArena();
+  void releaseArena(ArenaSlot *slot);
 
  private:
   struct Key {
@@ -104,24 +451,146 @@ class ProtoRPC {
     uint16_t Cmd;
   };
   struct Value {
-    Value(std::function<void(ErrNo, void *, uint32_t)> cb, time_t t)
-        : CallBack(std::move(cb)), Time(t) {}
-    std::function<void(ErrNo, void *, uint32_t)> CallBack;
-    time_t Time;
+    Value(ReplyFunc fn, void *arg, Conn *conn)
+        : Fn(fn),
+          Arg(arg),
+          C(conn),
+          S(nullptr),
+          QueuedBytes(0),
+          Stats(nullptr),
+          BeginUs(0) {}
+    void CallBack(ErrNo err, void *pdata, uint32_t size) const {
+      Fn(Arg, err, pdata, size);
+    }
+    ReplyFunc Fn;
+    void *Arg;
+    // 请求所在的连接,nullptr表示还在断线队列中
+    Conn *C;
+    // 流式调用的读取端,收到带MSG_FLAG_STREAM的帧时交给它
+    StreamBase *S;
+    size_t QueuedBytes;
+    CmdStats *Stats;
+    uint64_t BeginUs;
+  };
+  struct Conn {
+    Conn()
+        : Socket(nullptr),
+          ShmActive(false),
+          Gen(0),
+          ConnTime(0),
+          LastRecv(0),
+          HeartDead(false),
+          Compress(false),
+          Bulk(false) {}
+    TcpSocket *Socket;
+    std::shared_ptr<ShmChannel> Shm;
+    bool ShmActive;
+    uint32_t Gen;
+    uint64_t ConnTime;
+    uint64_t LastRecv;
+    bool HeartDead;
+    // 对端已确认支持压缩
+    bool Compress;
+    // 解压缓冲区,重复使用
+    std::string Inflate;
+    // 批量请求专用的连接
+    bool Bulk;
+  };
+  // 幂等cmd最近若干次调用的延迟(毫秒),重发延迟取其percentile分位
+  struct IdemPolicy {
+    double Percentile;
+    unsigned int MaxRetries;
+    std::vector<uint32_t> Samples;
+    size_t Next;
+    uint64_t Count;
+    unsigned int DelayMs;
+  };
+  // 一次幂等调用,同一时刻最多两个请求(原请求和重发)在途
+  struct IdemCall {
+    IdemCall(Epoll *e) : Ch(e), Err(0), Done(false), Pending(0), NumSeqs(0) {}
+    static void OnReply(void *arg, ErrNo err, void *pdata, uint32_t size);
+    GoChan Ch;
+    std::string Req;
+    ParseFunc Parse;
+    void *ParseArg;
+    uint32_t Flags;
+    bool Bulk;
+    bool InPlace;
+    ErrNo Err;
+    bool Done;
+    unsigned int Pending;
+    uint32_t Seqs[2];
+    Conn *Conns[2];
+    unsigned int NumSeqs;
+  };
+  struct QueuedMsg {
+    QueuedMsg(const Key &k, bool oneway, const std::string &data)
+        : K(k), OneWay(oneway), Data(data) {}
+    Key K;
+    bool OneWay;
+    std::string Data;
+  };
+  struct LimitWaiter {
+    LimitWaiter(Epoll *e)
+        : Ch(e), Prev(nullptr), Next(nullptr), TimedOut(false) {}
+    GoChan Ch;
+    LimitWaiter *Prev;
+    LimitWaiter *Next;
+    bool TimedOut;
+  };
+  struct FlightWaiter {
+    FlightWaiter(GoChan *ch, void *rsp) : Ch(ch), Rsp(rsp), Err(0) {}
+    GoChan *Ch;
+    void *Rsp;
+    ErrNo Err;
+  };
+  struct ArenaSlot {
+    ArenaSlot(size_t blockSize);
+    std::unique_ptr<char[]> Block;
+    google::protobuf::Arena Arena;
+    unsigned int Users;
   };
   struct KeyHash {
     std::size_t operator()(const Key &p) const { return p.Seq; }
   };
-  const unsigned int MSG_HEAD_LEN = 10;
+  typedef std::unordered_map<Key, Value, KeyHash> WaitMap;
+  // 开始/结束等待应答,同时更新cmd的统计
+  void trackWait(Value &v, uint16_t cmd, size_t bytes);
+  WaitMap::iterator eraseWait(WaitMap::iterator iter);
 
  private:
   Epoll *m_epoll;
-  std::unordered_map<Key, Value, KeyHash> m_waitResp;
-  std::string m_msg;
-  TcpSocket *m_psocket;
+  WaitMap m_waitResp;
+  std::unordered_map<std::string, std::vector<FlightWaiter *> *> m_flights;
+  std::deque<QueuedMsg> m_queue;
+  size_t m_queuedBytes;
+  size_t m_queueRawBytes;
+  std::vector<std::unique_ptr<Conn>> m_conns;
+  unsigned int m_connNum;
+  unsigned int m_bulkConnNum;
+  unsigned int m_connected;
+  size_t m_nextConn;
+  std::unordered_map<uint16_t, IdemPolicy> m_idempotent;
+  std::minstd_rand m_rand;
   std::string m_ip;
   uint16_t m_port;
   std::string m_unixPath;
   uint32_t m_reqSeq;
   std::string m_buffer;
+  std::unordered_map<uint16_t, unsigned int> m_cacheTTL;
+  RespCache m_cache;
+  RpcStats m_stats;
+  std::vector<std::unique_ptr<ArenaSlot>> m_arenas;
+  ArenaSlot *m_curArena;
+  size_t m_shmCapacity;
+  size_t m_compressMin;
+  std::string m_deflate;
+  unsigned int m_heartInterval;
+  unsigned int m_heartMaxMiss;
+  unsigned int m_reconnectMs;
+  unsigned int m_maxInFlight;
+  size_t m_maxQueuedBytes;
+  bool m_limitFailFast;
+  LimitWaiter *m_limitHead;
+  LimitWaiter *m_limitTail;
 };
@@ -0,0 +1,526 @@
+#include "protorpcserver.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+// 一次共享内存邀请携带的描述符数,连接上最多暂存这么多
+static const size_t SHM_OFFER_FDS = 3;
+// 描述符或内存不足时accept一直失败,隔这么久再试
+static const unsigned int ACCEPT_BACKOFF_MS = 100;
+
+ProtoRPCServer::ProtoRPCServer() {
+  m_epoll = nullptr;
+  m_poolSize = 64;
+  m_workers = 0;
+}
+
+ErrNo ProtoRPCServer::Start(Epoll *e, const char *szip, uint16_t port) {
+  m_epoll = e;
+  m_accept.reset(new AcceptSocket(e));
+  ErrNo err = m_accept->Listen(szip, port);
+  if (err) {
+    return err;
+  }
+  m_epoll->Go(std::bind(&ProtoRPCServer::Accept, this, std::placeholders::_1,
+                        m_accept.get()));
+  return 0;
+}
+
+ErrNo ProtoRPCServer::Start(Epoll *e, const char *unixPath) {
+  m_epoll = e;
+  m_accept.reset(new AcceptSocket(e));
+  ErrNo err = m_accept->Listen(unixPath);
+  if (err) {
+    return err;
+  }
+  m_epoll->Go(std::bind(&ProtoRPCServer::Accept, this, std::placeholders::_1,
+                        m_accept.get()));
+  return 0;
+}
+
+void ProtoRPCServer::Accept(GoContext &ctx, AcceptSocket *paccept) {
+  while (true) {
+    int s = -1;
+    ErrNo err = 0;
+    std::tie(s, err) = paccept->Accept(&ctx);
+    if (err == EBADF) {
+      // 监听socket已经关闭
+      return;
+    }
+    if (err) {
+      fprintf(stderr, "%s:%d accept failed errno=%d\n", __FILE__, __LINE__,
+              int(err));
+      if (err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM) {
+        ctx.SleepMs(ACCEPT_BACKOFF_MS);
+      }
+      continue;
+    }
+    m_epoll->Go(
+        std::bind(&ProtoRPCServer::Connect, this, std::placeholders::_1, s));
+  }
+}
+
+void ProtoRPCServer::Connect(GoContext &ctx, int s) {
+  auto conn = std::make_shared<Conn>(ctx.GetEpoll());
+  if (auto err = conn->Socket.Open(s)) {
+    fprintf(stderr, "%s:%d open socket failed errno=%d\n", __FILE__, __LINE__,
+            int(err));
+    return;
+  }
+  doConnect(ctx, conn);
+  conn->Closed = true;
+  conn->Out.clear();
+  for (auto &v : conn->Streams) {
+    if (v.second->m_ch != nullptr) {
+      v.second->m_ch->Wake();
+    }
+  }
+  conn->Socket.Close();
+  if (conn->Shm) {
+    conn->Shm->Close();
+  }
+  for (auto fd : conn->Fds) {
+    close(fd);
+  }
+  conn->Fds.clear();
+}
+
+ErrNo ProtoRPCServer::doConnect(GoContext &ctx, std::shared_ptr<Conn> &conn) {
+  char readBuffer[1024 * 1024 * 4];
+  size_t readBytes = 0;
+  while (true) {
+    if (readBytes == sizeof(readBuffer)) {
+      fprintf(stderr, "%s:%d msg size > readBuffer(%lu)\n", __FILE__, __LINE__,
+              (unsigned long int)(sizeof(readBuffer)));
+      return EMSGSIZE;
+    }
+    ErrNo err = 0;
+    size_t nread = 0;
+    int fds[4];
+    int nfds = sizeof(fds) / sizeof(fds[0]);
+    std::tie(nread, err) =
+        conn->Socket.ReadFds(&ctx, readBuffer + readBytes,
+                             sizeof(readBuffer) - readBytes, fds, nfds);
+    for (int i = 0; i < nfds; i++) {
+      if (conn->Shm || conn->Fds.size() >= SHM_OFFER_FDS) {
+        close(fds[i]);
+        continue;
+      }
+      conn->Fds.push_back(fds[i]);
+    }
+    if (err) {
+      fprintf(stderr, "%s:%d read socket failed errno=%d\n", __FILE__, __LINE__,
+              int(err));
+      return err;
+    }
+    if (nread == 0) {
+      return ENODATA;
+    }
+    readBytes += nread;
+    size_t procTotal = 0;
+    conn->Batching = true;
+    while (true) {
+      ErrNo err = 0;
+      size_t proc = 0;
+      std::tie(proc, err) =
+          onProcess(ctx, conn, readBuffer + procTotal, readBytes - procTotal);
+      if (err) {
+        conn->Batching = false;
+        return err;
+      }
+      if (proc == 0) {
+        break;
+      }
+      procTotal += proc;
+    }
+    conn->Batching = false;
+    flush(*conn);
+    if (procTotal > 0) {
+      memmove(readBuffer, readBuffer + procTotal, readBytes - procTotal);
+      readBytes -= procTotal;
+    }
+  }
+}
+
+std::tuple<size_t, ErrNo> ProtoRPCServer::onProcess(
+    GoContext &ctx, std::shared_ptr<Conn> &conn, void *pdata, size_t size) {
+  if (size < MSG_HEAD_LEN) {
+    return std::make_tuple<size_t, ErrNo>(size_t(0), ErrNo(0));
+  }
+  uint32_t length = 0;
+  uint32_t seq = 0;
+  uint16_t cmd = 0;
+  uint32_t flags = 0;
+  parseMsgHead(pdata, length, seq, cmd, flags);
+  if (length < MSG_HEAD_LEN) {
+    fprintf(stderr, "%s:%d msg length(%lu) < %lu\n", __FILE__, __LINE__,
+            (unsigned long int)(length), (unsigned long int)(MSG_HEAD_LEN));
+    return std::make_tuple<size_t, ErrNo>(size_t(0), ErrNo(EBADMSG));
+  }
+  if (length > size) {
+    return std::make_tuple<size_t, ErrNo>(size_t(0), ErrNo(0));
+  }
+  if (cmd == CMD_SHM_OFFER) {
+    attachShm(conn);
+    return std::make_tuple<size_t, ErrNo>(size_t(length), ErrNo(0));
+  }
+  if (cmd == CMD_COMPRESS_OFFER) {
+    uint32_t minBytes = 0;
+    if (length >= MSG_HEAD_LEN + sizeof(minBytes)) {
+      memcpy(&minBytes, (uint8_t *)pdata + MSG_HEAD_LEN, sizeof(minBytes));
+    }
+    conn->CompressMin = std::max<size_t>(ntohl(minBytes), MSG_HEAD_LEN + 1);
+    char head[MSG_HEAD_LEN];
+    serialMsgHead(head, MSG_HEAD_LEN, 0, CMD_COMPRESS_OFFER);
+    conn->Out.append(head, sizeof(head));
+    if (!conn->Batching) {
+      flush(*conn);
+    }
+    return std::make_tuple<size_t, ErrNo>(size_t(length), ErrNo(0));
+  }
+  if (flags & MSG_FLAG_LZ4) {
+    // 解压后的帧在Inflate中处理,handler返回之前不会再用到Inflate
+    if (auto err = inflateFrame(pdata, length, conn->Inflate)) {
+      fprintf(stderr, "%s:%d inflate seq:%lu cmd:%lu failed\n", __FILE__,
+              __LINE__, (unsigned long int)(seq), (unsigned long int)(cmd));
+      return std::make_tuple<size_t, ErrNo>(size_t(0), ErrNo(err));
+    }
+    ErrNo err = 0;
+    std::tie(std::ignore, err) =
+        onProcess(ctx, conn, &(conn->Inflate[0]), conn->Inflate.size());
+    return std::make_tuple<size_t, ErrNo>(size_t(length), ErrNo(err));
+  }
+  uint8_t *pbody = ((uint8_t *)pdata) + MSG_HEAD_LEN;
+  if (cmd == CMD_STREAM_CREDIT) {
+    onStreamCredit(*conn, seq, flags, pbody, length - MSG_HEAD_LEN);
+    return std::make_tuple<size_t, ErrNo>(size_t(length), ErrNo(0));
+  }
+  auto iter = m_handlers.find(cmd);
+  if (iter == m_handlers.end() && cmd == CMD_HEART_BEAT) {
+    size_t beg = conn->Out.size();
+    conn->Out.resize(beg + MSG_HEAD_LEN);
+    serialMsgHead(&(conn->Out[beg]), MSG_HEAD_LEN, seq, cmd);
+    if (!conn->Batching) {
+      flush(*conn);
+    }
+    return std::make_tuple<size_t, ErrNo>(size_t(length), ErrNo(0));
+  }
+  if (iter == m_handlers.end()) {
+    fprintf(stderr, "%s:%d unknown cmd:%lu\n", __FILE__, __LINE__,
+            (unsigned long int)(cmd));
+    errorReply(conn->Out, seq, cmd, ENOSYS);
+    if (!conn->Batching) {
+      flush(*conn);
+    }
+    return std::make_tuple<size_t, ErrNo>(size_t(length), ErrNo(0));
+  }
+  if (iter->second.StreamFunc) {
+    Handler *h = &(iter->second);
+    std::string data((const char *)pbody, length - MSG_HEAD_LEN);
+    m_epoll->Go([h, conn, seq, cmd, flags, data](GoContext &ctx) {
+      (h->StreamFunc)(ctx, conn, seq, cmd, flags, data);
+    });
+  } else if (iter->second.Pooled) {
+    Job job;
+    job.C = conn;
+    job.H = &(iter->second);
+    job.Seq = seq;
+    job.Cmd = cmd;
+    job.Flags = flags;
+    job.Data.assign((const char *)pbody, length - MSG_HEAD_LEN);
+    dispatch(std::move(job));
+  } else {
+    size_t frame = 0;
+    ErrNo err = 0;
+    std::tie(frame, err) = (iter->second.Func)(
+        ctx, seq, cmd, flags, pbody, length - MSG_HEAD_LEN, conn->Out);
+    compressTail(*conn, frame);
+    if (flags & MSG_FLAG_BULK) {
+      bulkTail(*conn, frame);
+    }
+    if (err) {
+      fprintf(stderr, "%s:%d handle cmd:%lu seq:%lu failed errno=%d\n",
+              __FILE__, __LINE__, (unsigned long int)(cmd),
+              (unsigned long int)(seq), int(err));
+    }
+  }
+  return std::make_tuple<size_t, ErrNo>(size_t(length), ErrNo(0));
+}
+
+std::tuple<size_t, ErrNo> ProtoRPCServer::errorReply(std::string &out,
+                                                     uint32_t seq,
+                                                     uint16_t cmd, ErrNo err) {
+  size_t beg = out.size();
+  char frame[MSG_HEAD_LEN + sizeof(uint32_t)];
+  serialMsgHead(frame, sizeof(frame), seq, cmd, MSG_FLAG_END);
+  uint32_t code = htonl(uint32_t(err));
+  memcpy(frame + MSG_HEAD_LEN, &code, sizeof(code));
+  out.append(frame, sizeof(frame));
+  return std::make_tuple(beg, err);
+}
+
+void ProtoRPCServer::dispatch(Job job) {
+  m_jobs.push_back(std::move(job));
+  if (!m_idle.empty()) {
+    GoChan *ch = m_idle.back();
+    m_idle.pop_back();
+    ch->Wake();
+    return;
+  }
+  if (m_workers < m_poolSize) {
+    ++m_workers;
+    m_epoll->Go(
+        std::bind(&ProtoRPCServer::PoolWorker, this, std::placeholders::_1));
+  }
+}
+
+void ProtoRPCServer::PoolWorker(GoContext &ctx) {
+  GoChan ch(ctx.GetEpoll());
+  while (true) {
+    if (m_jobs.empty()) {
+      m_idle.push_back(&ch);
+      ch.Wait(&ctx);
+      continue;
+    }
+    Job job = std::move(m_jobs.front());
+    m_jobs.pop_front();
+    if (job.C->Closed) {
+      continue;
+    }
+    size_t frame = 0;
+    ErrNo err = 0;
+    std::tie(frame, err) =
+        (job.H->Func)(ctx, job.Seq, job.Cmd, job.Flags, job.Data.data(),
+                      uint32_t(job.Data.size()), job.C->Out);
+    compressTail(*(job.C), frame);
+    if (job.Flags & MSG_FLAG_BULK) {
+      bulkTail(*(job.C), frame);
+    }
+    if (err) {
+      fprintf(stderr, "%s:%d handle cmd:%lu seq:%lu failed errno=%d\n",
+              __FILE__, __LINE__, (unsigned long int)(job.Cmd),
+              (unsigned long int)(job.Seq), int(err));
+    }
+    if (!job.C->Batching) {
+      flush(*(job.C));
+    }
+  }
+}
+
+void ProtoRPCServer::flush(Conn &conn) {
+  if (conn.Out.empty()) {
+    return;
+  }
+  if (conn.Closed) {
+    conn.Out.clear();
+    return;
+  }
+  if (!conn.Shm || (conn.ShmBypass && conn.ShmPending.empty())) {
+    conn.Socket.Write(&(conn.Out[0]), conn.Out.size());
+    conn.Out.clear();
+    return;
+  }
+  // 对端分两个协程读环和socket,同一连接的应答只能在一条通道上排队
+  if (conn.ShmPending.empty() &&
+      conn.Shm->Send(&(conn.Out[0]), conn.Out.size())) {
+    conn.Out.clear();
+    return;
+  }
+  conn.ShmPending.append(conn.Out);
+  conn.Out.clear();
+  if (!conn.ShmDraining) {
+    conn.ShmDraining = true;
+    m_epoll->Go(std::bind(&ProtoRPCServer::ShmWriter, this,
+                          std::placeholders::_1, conn.shared_from_this()));
+  }
+}
+
+// 暂存的应答按完整的帧分批写入环,每批不超过环的容量,环满时等对端的门铃
+// 单个帧比整个环还大时,等环里的帧都被对端取走后改走socket,之后不再回到环
+void ProtoRPCServer::ShmWriter(GoContext &ctx, std::shared_ptr<Conn> conn) {
+  auto shm = conn->Shm;
+  size_t sent = 0;
+  while (!conn->Closed && sent < conn->ShmPending.size()) {
+    auto &pending = conn->ShmPending;
+    size_t end = sent;
+    while (end < pending.size()) {
+      uint32_t length = 0;
+      uint32_t seq = 0;
+      uint16_t cmd = 0;
+      parseMsgHead(&(pending[end]), length, seq, cmd);
+      if (end + length - sent > shm->Capacity()) {
+        break;
+      }
+      end += length;
+    }
+    if (end > sent && shm->Send(&(pending[sent]), end - sent)) {
+      sent = end;
+      continue;
+    }
+    if ((end == sent && shm->Drained()) ||
+        shm->WaitSpace(&ctx, end == sent ? shm->Capacity() : end - sent)) {
+      // 环已关闭时同样改走socket
+      conn->ShmBypass = true;
+      conn->Socket.Write(&(pending[sent]), pending.size() - sent);
+      break;
+    }
+  }
+  conn->ShmPending.clear();
+  conn->ShmDraining = false;
+}
+
+// 压缩Out中从beg开始的一帧,共享内存通道上不压缩
+void ProtoRPCServer::compressTail(Conn &conn, size_t beg) {
+  size_t size = conn.Out.size() - beg;
+  if (conn.CompressMin == 0 || conn.Shm || size < conn.CompressMin) {
+    return;
+  }
+  if (compressFrame(&(conn.Out[beg]), uint32_t(size), m_deflate)) {
+    conn.Out.resize(beg);
+    conn.Out.append(m_deflate);
+  }
+}
+
+// 批量请求的应答直接写入socket的低优先级队列,排在其它应答之后
+void ProtoRPCServer::bulkTail(Conn &conn, size_t beg) {
+  if (conn.Shm || conn.Closed || conn.Out.size() == beg) {
+    return;
+  }
+  conn.Socket.WriteBulk(&(conn.Out[beg]), conn.Out.size() - beg);
+  conn.Out.resize(beg);
+}
+
+void ProtoRPCServer::attachShm(std::shared_ptr<Conn> &conn) {
+  if (conn->Shm || conn->Fds.size() < SHM_OFFER_FDS) {
+    fprintf(stderr, "%s:%d bad shm offer\n", __FILE__, __LINE__);
+    return;
+  }
+  int fds[SHM_OFFER_FDS] = {conn->Fds[0], conn->Fds[1], conn->Fds[2]};
+  conn->Fds.clear();
+  auto shm = std::make_shared<ShmChannel>(m_epoll);
+  if (auto err = shm->Attach(fds)) {
+    fprintf(stderr, "%s:%d attach shm failed errno=%d\n", __FILE__, __LINE__,
+            int(err));
+    return;
+  }
+  char head[MSG_HEAD_LEN];
+  serialMsgHead(head, MSG_HEAD_LEN, 0, CMD_SHM_OFFER);
+  conn->Socket.Write(head, sizeof(head));
+  conn->Shm = shm;
+  m_epoll->Go(std::bind(&ProtoRPCServer::ShmReader, this, std::placeholders::_1,
+                        conn));
+}
+
+void ProtoRPCServer::ShmReader(GoContext &ctx, std::shared_ptr<Conn> conn) {
+  auto shm = conn->Shm;
+  while (true) {
+    const uint8_t *pdata = nullptr;
+    size_t size = 0;
+    ErrNo err = 0;
+    std::tie(pdata, size, err) = shm->Peek(&ctx);
+    if (err) {
+      return;
+    }
+    size_t procTotal = 0;
+    conn->Batching = true;
+    while (procTotal < size) {
+      size_t proc = 0;
+      std::tie(proc, err) =
+          onProcess(ctx, conn, (void *)(pdata + procTotal), size - procTotal);
+      if (err || proc == 0) {
+        fprintf(stderr, "%s:%d bad frame in shm ring\n", __FILE__, __LINE__);
+        conn->Batching = false;
+        shm->Close();
+        return;
+      }
+      procTotal += proc;
+    }
+    conn->Batching = false;
+    shm->Consume(procTotal);
+    flush(*conn);
+  }
+}
+
+void ProtoRPCServer::onStreamCredit(Conn &conn, uint32_t seq, uint32_t flags,
+                                    const void *pdata, uint32_t size) {
+  auto iter = conn.Streams.find(seq);
+  if (iter == conn.Streams.end()) {
+    return;
+  }
+  StreamWriterBase *writer = iter->second;
+  if (flags & MSG_FLAG_END) {
+    writer->m_cancelled = true;
+  } else if (size >= sizeof(uint32_t)) {
+    uint32_t credit = 0;
+    memcpy(&credit, pdata, sizeof(credit));
+    writer->m_credit += ntohl(credit);
+  }
+  if (writer->m_ch != nullptr) {
+    writer->m_ch->Wake();
+  }
+}
+
+ProtoRPCServer::StreamWriterBase::StreamWriterBase(
+    ProtoRPCServer *server, const std::shared_ptr<Conn> &conn, uint32_t seq,
+    uint16_t cmd)
+    : m_server(server), m_conn(conn), m_seq(seq), m_cmd(cmd) {
+  m_credit = STREAM_WINDOW;
+  m_cancelled = false;
+  m_ch = nullptr;
+  m_conn->Streams[m_seq] = this;
+}
+
+ProtoRPCServer::StreamWriterBase::~StreamWriterBase() {
+  auto iter = m_conn->Streams.find(m_seq);
+  if (iter != m_conn->Streams.end() && iter->second == this) {
+    m_conn->Streams.erase(iter);
+  }
+}
+
+ErrNo ProtoRPCServer::StreamWriterBase::write(GoContext &ctx,
+                                              uint32_t flags) {
+  while (m_credit == 0 && !m_cancelled && !m_conn->Closed) {
+    GoChan ch(ctx.GetEpoll());
+    m_ch = &ch;
+    ch.Wait(&ctx);
+    m_ch = nullptr;
+  }
+  if (m_conn->Closed) {
+    return EPIPE;
+  }
+  if (m_cancelled) {
+    return ECANCELED;
+  }
+  --m_credit;
+  serialMsgHead(&(m_buf[0]), uint32_t(m_buf.size()), m_seq, m_cmd,
+                MSG_FLAG_STREAM | flags);
+  size_t beg = m_conn->Out.size();
+  m_conn->Out.append(m_buf);
+  m_server->compressTail(*m_conn, beg);
+  if (!m_conn->Batching) {
+    m_server->flush(*m_conn);
+  }
+  return 0;
+}
+
+void ProtoRPCServer::StreamWriterBase::end(ErrNo err) {
+  if (m_conn->Closed || m_cancelled) {
+    return;
+  }
+  if (err) {
+    fprintf(stderr, "%s:%d stream cmd:%lu seq:%lu failed errno=%d\n",
+            __FILE__, __LINE__, (unsigned long int)(m_cmd),
+            (unsigned long int)(m_seq), int(err));
+  }
+  char frame[MSG_HEAD_LEN + sizeof(uint32_t)];
+  serialMsgHead(frame, sizeof(frame), m_seq, m_cmd,
+                MSG_FLAG_STREAM | MSG_FLAG_END);
+  uint32_t code = htonl(uint32_t(err));
+  memcpy(frame + MSG_HEAD_LEN, &code, sizeof(code));
+  m_conn->Out.append(frame, sizeof(frame));
+  if (!m_conn->Batching) {
+    m_server->flush(*m_conn);
+  }
+}
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+
+#include "protorpc.h"
+
+class ProtoRPCServer {
+  struct Conn;
+
+ public:
+  class StreamWriterBase {
+   public:
+    StreamWriterBase(ProtoRPCServer *server, const std::shared_ptr<Conn> &conn,
+                     uint32_t seq, uint16_t cmd);
+    StreamWriterBase(const StreamWriterBase &) = delete;
+    StreamWriterBase &operator=(const StreamWriterBase &) = delete;
+    ~StreamWriterBase();
+
+   protected:
+    ErrNo write(GoContext &ctx, uint32_t flags);
+
+   protected:
+    std::string m_buf;
+
+   private:
+    friend class ProtoRPCServer;
+    void end(ErrNo err);
+
+   private:
+    ProtoRPCServer *m_server;
+    std::shared_ptr<Conn> m_conn;
+    uint32_t m_seq;
+    uint16_t m_cmd;
+    unsigned int m_credit;
+    bool m_cancelled;
+    GoChan *m_ch;
+  };
+  // 流式应答的写入端,对端额度用完时Write挂起等待
+  // 对端放弃读取返回ECANCELED,连接断开返回EPIPE
+  template <typename Rsp>
+  class StreamWriter : public StreamWriterBase {
+   public:
+    using StreamWriterBase::StreamWriterBase;
+    ErrNo Write(GoContext &ctx, const Rsp &msg) {
+      m_buf.resize(MSG_HEAD_LEN);
+      if (!msg.AppendToString(&m_buf)) {
+        fprintf(stderr, "%s:%d AppendToString failed\n", __FILE__, __LINE__);
+        return EBADMSG;
+      }
+      return write(ctx, msgFlags<Rsp>());
+    }
+  };
+
+ public:
+  ProtoRPCServer();
+  ProtoRPCServer(const ProtoRPCServer &) = delete;
+  ProtoRPCServer &operator=(const ProtoRPCServer &) = delete;
+
+  ErrNo Start(Epoll *e, const char *szip, uint16_t port);
+  ErrNo Start(Epoll *e, const char *unixPath);
+  void SetPoolSize(unsigned int num) { m_poolSize = num; }
+
+  // pooled为false时handler在连接协程中直接执行,否则交给协程池执行
+  // Req/Rsp可以是protobuf消息或FlatMsg子类,同一个cmd两端必须使用相同的格式
+  template <typename Req, typename Rsp>
+  void Register(uint16_t cmd,
+                std::function<ErrNo(GoContext &, const Req &, Rsp &)> handler,
+                bool pooled = false) {
+    Handler h;
+    h.Pooled = pooled;
+    h.Func = [handler](GoContext &ctx, uint32_t seq, uint16_t cmd,
+                       uint32_t flags, const void *pdata, uint32_t size,
+                       std::string &out) -> std::tuple<size_t, ErrNo> {
+      if ((flags & MSG_FLAG_FLAT) != msgFlags<Req>()) {
+        fprintf(stderr, "%s:%d cmd:%lu wire format mismatch flags:%lx\n",
+                __FILE__, __LINE__, (unsigned long int)cmd,
+                (unsigned long int)flags);
+        return errorReply(out, seq, cmd, EBADMSG);
+      }
+      Req req;
+      if (!parseMsgBody(req, pdata, size)) {
+        fprintf(stderr, "%s:%d cmd:%lu parse failed\n", __FILE__, __LINE__,
+                (unsigned long int)cmd);
+        return errorReply(out, seq, cmd, EBADMSG);
+      }
+      Rsp rsp;
+      ErrNo err = handler(ctx, req, rsp);
+      if (err) {
+        return errorReply(out, seq, cmd, err);
+      }
+      // handler可能挂起,期间out被其它应答追加或被flush清空,返回后才取帧起点
+      size_t beg = out.size();
+      out.resize(beg + MSG_HEAD_LEN);
+      if (!rsp.AppendToString(&out)) {
+        fprintf(stderr, "%s:%d cmd:%lu AppendToString failed\n", __FILE__,
+                __LINE__, (unsigned long int)cmd);
+        out.resize(beg);
+        return errorReply(out, seq, cmd, EBADMSG);
+      }
+      serialMsgHead(&(out[beg]), uint32_t(out.size() - beg), seq, cmd,
+                    msgFlags<Rsp>());
+      return std::make_tuple(beg, ErrNo(0));
+    };
+    m_handlers[cmd] = std::move(h);
+  }
+  // 流式handler在独立的协程中执行,返回后发送结束帧,返回值作为流的错误码
+  template <typename Req, typename Rsp>
+  void RegisterStream(
+      uint16_t cmd,
+      std::function<ErrNo(GoContext &, const Req &, StreamWriter<Rsp> &)>
+          handler) {
+    Handler h;
+    h.Pooled = false;
+    h.StreamFunc = [this, handler](GoContext &ctx,
+                                   const std::shared_ptr<Conn> &conn,
+                                   uint32_t seq, uint16_t cmd, uint32_t flags,
+                                   const std::string &data) {
+      StreamWriter<Rsp> writer(this, conn, seq, cmd);
+      Req req;
+      if ((flags & MSG_FLAG_FLAT) != msgFlags<Req>() ||
+          !parseMsgBody(req, data.data(), uint32_t(data.size()))) {
+        fprintf(stderr, "%s:%d cmd:%lu ParseFromString failed\n", __FILE__,
+                __LINE__, (unsigned long int)cmd);
+        writer.end(EBADMSG);
+        return;
+      }
+      writer.end(handler(ctx, req, writer));
+    };
+    m_handlers[cmd] = std::move(h);
+  }
+
+ private:
+  struct Handler {
+    // 应答帧追加到最后一个参数,返回该帧在其中的起点
+    std::function<std::tuple<size_t, ErrNo>(GoContext &, uint32_t, uint16_t,
+                                            uint32_t, const void *, uint32_t,
+                                            std::string &)>
+        Func;
+    std::function<void(GoContext &, const std::shared_ptr<Conn> &, uint32_t,
+                       uint16_t, uint32_t, const std::string &)>
+        StreamFunc;
+    bool Pooled;
+  };
+  struct Conn : public std::enable_shared_from_this<Conn> {
+    Conn(Epoll *e)
+        : Socket(e),
+          ShmDraining(false),
+          ShmBypass(false),
+          Closed(false),
+          Batching(false),
+          CompressMin(0) {}
+    TcpSocket Socket;
+    std::shared_ptr<ShmChannel> Shm;
+    // 环满时暂存的应答,按顺序等环有空间再发出
+    std::string ShmPending;
+    bool ShmDraining;
+    // 有帧比整个环还大而改走了socket,之后的应答都走socket保持顺序
+    bool ShmBypass;
+    std::vector<int> Fds;
+    std::string Out;
+    // 进行中的流式应答,key为seq
+    std::unordered_map<uint32_t, StreamWriterBase *> Streams;
+    bool Closed;
+    bool Batching;
+    // 对端协商的压缩阈值,0为不压缩
+    size_t CompressMin;
+    // 解压缓冲区,handler执行期间请求包体指向这里
+    std::string Inflate;
+  };
+  struct Job {
+    std::shared_ptr<Conn> C;
+    Handler *H;
+    uint32_t Seq;
+    uint16_t Cmd;
+    uint32_t Flags;
+    std::string Data;
+  };
+
+ private:
+  void Accept(GoContext &ctx, AcceptSocket *paccept);
+  void Connect(GoContext &ctx, int s);
+  void PoolWorker(GoContext &ctx);
+  void ShmReader(GoContext &ctx, std::shared_ptr<Conn> conn);
+  void ShmWriter(GoContext &ctx, std::shared_ptr<Conn> conn);
+  void attachShm(std::shared_ptr<Conn> &conn);
+  ErrNo doConnect(GoContext &ctx, std::shared_ptr<Conn> &conn);
+  std::tuple<size_t, ErrNo> onProcess(GoContext &ctx,
+                                      std::shared_ptr<Conn> &conn,
+                                      void *pdata, size_t size);
+  void dispatch(Job job);
+  // 调用失败时回复带MSG_FLAG_END的错误帧,调用方不必等到超时
+  static std::tuple<size_t, ErrNo> errorReply(std::string &out, uint32_t seq,
+                                              uint16_t cmd, ErrNo err);
+  void flush(Conn &conn);
+  void compressTail(Conn &conn, size_t beg);
+  void bulkTail(Conn &conn, size_t beg);
+  void onStreamCredit(Conn &conn, uint32_t seq, uint32_t flags,
+                      const void *pdata, uint32_t size);
+
+ private:
+  Epoll *m_epoll;
+  std::unique_ptr<AcceptSocket> m_accept;
+  std::unordered_map<uint16_t, Handler> m_handlers;
+  std::deque<Job> m_jobs;
+  std::vector<GoChan *> m_idle;
+  std::string m_deflate;
+  unsigned int m_poolSize;
+  unsigned int m_workers;
+};
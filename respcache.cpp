@@ -0,0 +1,183 @@
+#include "respcache.h"
+
+#include <functional>
+
+const uint32_t RespCache::NIL;
+
+RespCache::RespCache(size_t budget) {
+  m_index.assign(64, NIL);
+  m_free = NIL;
+  m_head = NIL;
+  m_tail = NIL;
+  m_count = 0;
+  m_bytes = 0;
+  m_budget = budget;
+  m_hits = 0;
+  m_misses = 0;
+}
+
+void RespCache::SetBudget(size_t budget) {
+  m_budget = budget;
+  while (m_bytes > m_budget && m_tail != NIL) {
+    erase(find(m_entries[m_tail].Key, m_entries[m_tail].Hash));
+  }
+}
+
+const std::string *RespCache::Get(const std::string &key, uint64_t now) {
+  size_t slot = find(key, std::hash<std::string>()(key));
+  if (slot == m_index.size()) {
+    ++m_misses;
+    return nullptr;
+  }
+  uint32_t idx = m_index[slot];
+  if (m_entries[idx].Expire <= now) {
+    erase(slot);
+    ++m_misses;
+    return nullptr;
+  }
+  if (idx != m_head) {
+    unlink(idx);
+    link(idx);
+  }
+  ++m_hits;
+  return &(m_entries[idx].Value);
+}
+
+void RespCache::Put(const std::string &key, const void *pdata, size_t size,
+                    uint64_t expire) {
+  size_t hash = std::hash<std::string>()(key);
+  size_t slot = find(key, hash);
+  if (slot != m_index.size()) {
+    erase(slot);
+  }
+  if (key.size() + size + sizeof(Entry) > m_budget) {
+    return;
+  }
+  if ((m_count + 1) * 2 > m_index.size()) {
+    grow();
+  }
+  uint32_t idx = m_free;
+  if (idx == NIL) {
+    idx = uint32_t(m_entries.size());
+    m_entries.emplace_back();
+  } else {
+    m_free = m_entries[idx].Next;
+  }
+  Entry &e = m_entries[idx];
+  e.Key = key;
+  e.Value.assign((const char *)pdata, size);
+  e.Expire = expire;
+  e.Hash = hash;
+  link(idx);
+  size_t mask = m_index.size() - 1;
+  size_t i = hash & mask;
+  while (m_index[i] != NIL) {
+    i = (i + 1) & mask;
+  }
+  m_index[i] = idx;
+  ++m_count;
+  m_bytes += cost(e);
+  while (m_bytes > m_budget && m_tail != NIL) {
+    erase(find(m_entries[m_tail].Key, m_entries[m_tail].Hash));
+  }
+}
+
+void RespCache::Clear() {
+  m_entries.clear();
+  m_index.assign(64, NIL);
+  m_free = NIL;
+  m_head = NIL;
+  m_tail = NIL;
+  m_count = 0;
+  m_bytes = 0;
+}
+
+size_t RespCache::find(const std::string &key, size_t hash) {
+  size_t mask = m_index.size() - 1;
+  size_t i = hash & mask;
+  while (m_index[i] != NIL) {
+    const Entry &e = m_entries[m_index[i]];
+    if (e.Hash == hash && e.Key == key) {
+      return i;
+    }
+    i = (i + 1) & mask;
+  }
+  return m_index.size();
+}
+
+void RespCache::erase(size_t slot) {
+  uint32_t idx = m_index[slot];
+  Entry &e = m_entries[idx];
+  m_bytes -= cost(e);
+  --m_count;
+  unlink(idx);
+  e.Key.clear();
+  e.Key.shrink_to_fit();
+  e.Value.clear();
+  e.Value.shrink_to_fit();
+  e.Next = m_free;
+  m_free = idx;
+  // 线性探测删除: 把后续同簇元素前移,不留墓碑
+  size_t mask = m_index.size() - 1;
+  size_t i = slot;
+  size_t j = slot;
+  while (true) {
+    j = (j + 1) & mask;
+    if (m_index[j] == NIL) {
+      break;
+    }
+    size_t k = m_entries[m_index[j]].Hash & mask;
+    if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+      m_index[i] = m_index[j];
+      i = j;
+    }
+  }
+  m_index[i] = NIL;
+}
+
+void RespCache::grow() {
+  std::vector<uint32_t> index(m_index.size() * 2, NIL);
+  size_t mask = index.size() - 1;
+  for (auto v : m_index) {
+    if (v == NIL) {
+      continue;
+    }
+    size_t i = m_entries[v].Hash & mask;
+    while (index[i] != NIL) {
+      i = (i + 1) & mask;
+    }
+    index[i] = v;
+  }
+  m_index.swap(index);
+}
+
+void RespCache::link(uint32_t idx) {
+  Entry &e = m_entries[idx];
+  e.Prev = NIL;
+  e.Next = m_head;
+  if (m_head != NIL) {
+    m_entries[m_head].Prev = idx;
+  }
+  m_head = idx;
+  if (m_tail == NIL) {
+    m_tail = idx;
+  }
+}
+
+void RespCache::unlink(uint32_t idx) {
+  Entry &e = m_entries[idx];
+  if (e.Prev != NIL) {
+    m_entries[e.Prev].Next = e.Next;
+  } else {
+    m_head = e.Next;
+  }
+  if (e.Next != NIL) {
+    m_entries[e.Next].Prev = e.Prev;
+  } else {
+    m_tail = e.Prev;
+  }
+}
+
+size_t RespCache::cost(const Entry &e) const {
+  return e.Key.size() + e.Value.size() + sizeof(Entry) + sizeof(uint32_t) * 2;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// 应答缓存,开放寻址索引+LRU淘汰,按内存预算与过期时间管理
+// 每个Epoll单线程使用,不加锁
+class RespCache {
+ public:
+  RespCache(size_t budget = 64 * 1024 * 1024);
+  RespCache(const RespCache &) = delete;
+  RespCache &operator=(const RespCache &) = delete;
+
+  void SetBudget(size_t budget);
+  const std::string *Get(const std::string &key, uint64_t now);
+  void Put(const std::string &key, const void *pdata, size_t size,
+           uint64_t expire);
+  void Clear();
+
+  uint64_t Hits() const { return m_hits; }
+  uint64_t Misses() const { return m_misses; }
+  size_t Count() const { return m_count; }
+  size_t Bytes() const { return m_bytes; }
+
+ private:
+  struct Entry {
+    std::string Key;
+    std::string Value;
+    uint64_t Expire;
+    size_t Hash;
+    uint32_t Prev;
+    uint32_t Next;
+  };
+  static const uint32_t NIL = 0xFFFFFFFF;
+
+ private:
+  size_t find(const std::string &key, size_t hash);
+  void erase(size_t slot);
+  void grow();
+  void link(uint32_t idx);
+  void unlink(uint32_t idx);
+  size_t cost(const Entry &e) const;
+
+ private:
+  std::vector<Entry> m_entries;
+  std::vector<uint32_t> m_index;
+  uint32_t m_free;
+  uint32_t m_head;
+  uint32_t m_tail;
+  size_t m_count;
+  size_t m_bytes;
+  size_t m_budget;
+  uint64_t m_hits;
+  uint64_t m_misses;
+};
@@ -0,0 +1,335 @@
+#include <google/protobuf/descriptor.pb.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <string>
+#include <vector>
+
+/*
+  根据proto文件生成类型化的rpc桩代码
+  protoc --include_imports --descriptor_set_out=ctogo.desc ctogo.proto
+  rpcgen [--namespace=ns] ctogo.desc ctogo.rpc.h
+
+  约定: 枚举CmdID中的每个值FOO_BAR对应消息FooBarReq和FooBarRsp
+  两个消息都存在时生成请求/应答桩,只有FooBarReq时生成单向桩,否则跳过
+  字段全部是标量或字符串的消息额外生成flat格式的XxxFlat,见flatmsg.h
+  值FOO_BAR_FLAT使用FooBarReqFlat和FooBarRspFlat,桩名为FooBarFlat,
+  应答通过参数返回,不经过tuple拷贝
+*/
+
+using google::protobuf::DescriptorProto;
+using google::protobuf::FieldDescriptorProto;
+using google::protobuf::FileDescriptorProto;
+using google::protobuf::FileDescriptorSet;
+
+struct Rpc {
+  std::string Cmd;
+  std::string Name;
+  // 请求/应答消息名的公共部分,FooBarReq的FooBar
+  std::string Msg;
+  bool OneWay;
+  bool Flat;
+};
+
+static std::string camelCase(const std::string &name) {
+  std::string out;
+  bool upper = true;
+  for (char c : name) {
+    if (c == '_') {
+      upper = true;
+      continue;
+    }
+    out.push_back(upper ? char(toupper(c)) : char(tolower(c)));
+    upper = false;
+  }
+  return out;
+}
+
+static std::string baseName(const std::string &path) {
+  std::string name = path.substr(path.find_last_of('/') + 1);
+  return name.substr(0, name.find_last_of('.'));
+}
+
+// 返回flat格式的C++类型,字符串返回"string",不支持的字段返回空串
+static std::string flatType(const FieldDescriptorProto &field) {
+  if (field.label() == FieldDescriptorProto::LABEL_REPEATED) {
+    return "";
+  }
+  switch (field.type()) {
+    case FieldDescriptorProto::TYPE_DOUBLE:
+      return "double";
+    case FieldDescriptorProto::TYPE_FLOAT:
+      return "float";
+    case FieldDescriptorProto::TYPE_INT64:
+    case FieldDescriptorProto::TYPE_SINT64:
+    case FieldDescriptorProto::TYPE_SFIXED64:
+      return "int64_t";
+    case FieldDescriptorProto::TYPE_UINT64:
+    case FieldDescriptorProto::TYPE_FIXED64:
+      return "uint64_t";
+    case FieldDescriptorProto::TYPE_INT32:
+    case FieldDescriptorProto::TYPE_SINT32:
+    case FieldDescriptorProto::TYPE_SFIXED32:
+      return "int32_t";
+    case FieldDescriptorProto::TYPE_UINT32:
+    case FieldDescriptorProto::TYPE_FIXED32:
+      return "uint32_t";
+    case FieldDescriptorProto::TYPE_BOOL:
+      return "bool";
+    case FieldDescriptorProto::TYPE_STRING:
+    case FieldDescriptorProto::TYPE_BYTES:
+      return "string";
+    default:
+      return "";
+  }
+}
+
+static std::string lowerCase(const std::string &name) {
+  std::string out;
+  for (char c : name) {
+    out.push_back(char(tolower(c)));
+  }
+  return out;
+}
+
+static bool flatCapable(const DescriptorProto &msg) {
+  for (auto &v : msg.field()) {
+    if (flatType(v).empty()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// 槽位按字段编号排列,proto只允许追加字段,新旧两端的槽位保持兼容
+static void emitFlat(FILE *fp, const DescriptorProto &msg) {
+  if (!flatCapable(msg)) {
+    return;
+  }
+  std::vector<const FieldDescriptorProto *> fields;
+  for (auto &v : msg.field()) {
+    fields.push_back(&v);
+  }
+  std::sort(fields.begin(), fields.end(),
+            [](const FieldDescriptorProto *a, const FieldDescriptorProto *b) {
+              return a->number() < b->number();
+            });
+  std::string cls = msg.name() + "Flat";
+  fprintf(fp, "\n// %s的flat格式\n", msg.name().c_str());
+  fprintf(fp, "class %s : public FlatMsg {\n", cls.c_str());
+  fprintf(fp, " public:\n");
+  fprintf(fp, "  %s() : FlatMsg(%lu) {}\n", cls.c_str(),
+          (unsigned long int)(fields.size()));
+  for (size_t i = 0; i < fields.size(); ++i) {
+    std::string type = flatType(*fields[i]);
+    std::string name = lowerCase(fields[i]->name());
+    if (type == "string") {
+      fprintf(fp, "  FlatStr %s() const { return getStr(%lu); }\n",
+              name.c_str(), (unsigned long int)i);
+      fprintf(fp, "  void set_%s(const std::string &v) {\n", name.c_str());
+      fprintf(fp, "    setStr(%lu, v.data(), v.size());\n",
+              (unsigned long int)i);
+      fprintf(fp, "  }\n");
+      fprintf(fp,
+              "  void set_%s(const char *p, size_t n) { setStr(%lu, p, n); }"
+              "\n",
+              name.c_str(), (unsigned long int)i);
+      continue;
+    }
+    fprintf(fp, "  %s %s() const { return getScalar<%s>(%lu); }\n",
+            type.c_str(), name.c_str(), type.c_str(), (unsigned long int)i);
+    fprintf(fp, "  void set_%s(%s v) { setScalar(%lu, v); }\n", name.c_str(),
+            type.c_str(), (unsigned long int)i);
+  }
+  fprintf(fp, "};\n");
+}
+
+// flat类型生成在桩文件里,不在proto的命名空间中
+static std::string msgType(const Rpc &rpc, const std::string &q,
+                           const char *kind) {
+  if (rpc.Flat) {
+    return rpc.Msg + kind + "Flat";
+  }
+  return q + rpc.Msg + kind;
+}
+
+static void emit(FILE *fp, const FileDescriptorProto &file,
+                 const std::string &ns, const std::vector<Rpc> &rpcs) {
+  const std::string &proto = file.name();
+  std::string base = baseName(proto);
+  std::string prefix = camelCase(base);
+  std::string traits = prefix + "Traits";
+  std::string cls = prefix + "RPC";
+  std::string q = ns.empty() ? "" : ns + "::";
+  fprintf(fp, "// 由rpcgen根据%s生成,不要手工修改\n", proto.c_str());
+  fprintf(fp, "#pragma once\n\n");
+  fprintf(fp, "#include \"%s.pb.h\"\n", base.c_str());
+  fprintf(fp, "#include \"flatmsg.h\"\n");
+  fprintf(fp, "#include \"protorpcserver.h\"\n");
+  for (auto &v : file.message_type()) {
+    emitFlat(fp, v);
+  }
+  fprintf(fp, "\n");
+  fprintf(fp, "// cmd对应的请求/应答类型,编译期确定\n");
+  fprintf(fp, "template <uint16_t CMD>\nstruct %s;\n", traits.c_str());
+  for (auto &v : rpcs) {
+    fprintf(fp, "\ntemplate <>\nstruct %s<%s%s> {\n", traits.c_str(),
+            q.c_str(), v.Cmd.c_str());
+    fprintf(fp, "  typedef %s Req;\n", msgType(v, q, "Req").c_str());
+    if (!v.OneWay) {
+      fprintf(fp, "  typedef %s Rsp;\n", msgType(v, q, "Rsp").c_str());
+    }
+    fprintf(fp, "};\n");
+  }
+  fprintf(fp, "\n// 按cmd注册服务端handler,请求/应答类型由cmd确定\n");
+  fprintf(fp, "template <uint16_t CMD>\n");
+  fprintf(fp, "void Register%s(\n", prefix.c_str());
+  fprintf(fp, "    ProtoRPCServer &server,\n");
+  fprintf(fp,
+          "    std::function<ErrNo(GoContext &, "
+          "const typename %s<CMD>::Req &,\n",
+          traits.c_str());
+  fprintf(fp, "                        typename %s<CMD>::Rsp &)>\n",
+          traits.c_str());
+  fprintf(fp, "        handler,\n");
+  fprintf(fp, "    bool pooled = false) {\n");
+  fprintf(fp, "  typedef typename %s<CMD>::Req Req;\n", traits.c_str());
+  fprintf(fp, "  typedef typename %s<CMD>::Rsp Rsp;\n", traits.c_str());
+  fprintf(fp,
+          "  server.Register<Req, Rsp>(CMD, std::move(handler), pooled);\n");
+  fprintf(fp, "}\n\n");
+  fprintf(fp, "class %s : public ProtoRPC {\n", cls.c_str());
+  fprintf(fp, " public:\n");
+  for (auto &v : rpcs) {
+    std::string req = msgType(v, q, "Req");
+    std::string rsp = msgType(v, q, "Rsp");
+    fprintf(fp, "  // %s\n", v.Cmd.c_str());
+    if (v.OneWay) {
+      fprintf(fp, "  void %s(GoContext *ctx, const %s &req,\n", v.Name.c_str(),
+              req.c_str());
+      fprintf(fp, "      CallPriority priority = PRIORITY_INTERACTIVE) {\n");
+      fprintf(fp, "    Call(ctx, %s%s, req, priority);\n", q.c_str(),
+              v.Cmd.c_str());
+      fprintf(fp, "  }\n");
+      continue;
+    }
+    if (v.Flat) {
+      fprintf(fp, "  // rsp直接引用收到的字节,有效期见ProtoRPC::Call\n");
+      fprintf(fp, "  ErrNo %s(\n", v.Name.c_str());
+      fprintf(fp, "      GoContext *ctx, const %s &req,\n", req.c_str());
+      fprintf(fp, "      %s &rsp, unsigned int timeoutMs = CALL_TIMEOUT_MS,\n",
+              rsp.c_str());
+      fprintf(fp, "      CallPriority priority = PRIORITY_INTERACTIVE) {\n");
+      fprintf(fp,
+              "    return Call(ctx, %s%s, req, rsp, timeoutMs, priority);\n",
+              q.c_str(), v.Cmd.c_str());
+      fprintf(fp, "  }\n");
+      continue;
+    }
+    fprintf(fp, "  std::tuple<%s, ErrNo> %s(\n", rsp.c_str(), v.Name.c_str());
+    fprintf(fp, "      GoContext *ctx, const %s &req,\n", req.c_str());
+    fprintf(fp, "      unsigned int timeoutMs = CALL_TIMEOUT_MS,\n");
+    fprintf(fp, "      CallPriority priority = PRIORITY_INTERACTIVE) {\n");
+    fprintf(fp, "    return Invoke<%s%s>(ctx, req, timeoutMs, priority);\n",
+            q.c_str(), v.Cmd.c_str());
+    fprintf(fp, "  }\n");
+  }
+  fprintf(fp, "\n protected:\n");
+  fprintf(fp, "  template <uint16_t CMD>\n");
+  fprintf(fp, "  std::tuple<typename %s<CMD>::Rsp, ErrNo> Invoke(\n",
+          traits.c_str());
+  fprintf(fp, "      GoContext *ctx, const typename %s<CMD>::Req &req,\n",
+          traits.c_str());
+  fprintf(fp, "      unsigned int timeoutMs, CallPriority priority) {\n");
+  fprintf(fp, "    typename %s<CMD>::Rsp rsp;\n", traits.c_str());
+  fprintf(fp,
+          "    ErrNo err = Call(ctx, CMD, req, rsp, timeoutMs, priority);\n");
+  fprintf(fp, "    return std::make_tuple(std::move(rsp), err);\n");
+  fprintf(fp, "  }\n");
+  fprintf(fp, "};\n");
+}
+
+int main(int argc, char **argv) {
+  std::string ns;
+  bool hasNs = false;
+  int argi = 1;
+  if (argi < argc && strncmp(argv[argi], "--namespace=", 12) == 0) {
+    ns = argv[argi] + 12;
+    hasNs = true;
+    ++argi;
+  }
+  if (argc - argi != 2) {
+    fprintf(stderr, "usage: %s [--namespace=ns] <descriptor_set> <out.h>\n",
+            argv[0]);
+    return 1;
+  }
+  std::ifstream in(argv[argi], std::ios::binary);
+  FileDescriptorSet set;
+  if (!in || !set.ParseFromIstream(&in) || set.file_size() == 0) {
+    fprintf(stderr, "%s:%d read %s failed\n", __FILE__, __LINE__, argv[argi]);
+    return 1;
+  }
+  // --include_imports时被依赖的文件在前,最后一个是目标文件
+  const FileDescriptorProto &file = set.file(set.file_size() - 1);
+  if (!hasNs) {
+    for (char c : file.package()) {
+      if (c == '.') {
+        ns.append("::");
+      } else {
+        ns.push_back(c);
+      }
+    }
+  }
+  std::set<std::string> messages;
+  std::set<std::string> flats;
+  for (auto &v : file.message_type()) {
+    messages.insert(v.name());
+    if (flatCapable(v)) {
+      flats.insert(v.name());
+    }
+  }
+  const std::string flatSuffix = "_FLAT";
+  std::vector<Rpc> rpcs;
+  for (auto &e : file.enum_type()) {
+    if (e.name() != "CmdID") {
+      continue;
+    }
+    for (auto &v : e.value()) {
+      Rpc rpc;
+      rpc.Cmd = v.name();
+      rpc.Name = camelCase(v.name());
+      rpc.Msg = rpc.Name;
+      rpc.Flat = v.name().size() > flatSuffix.size() &&
+                 v.name().compare(v.name().size() - flatSuffix.size(),
+                                  flatSuffix.size(), flatSuffix) == 0;
+      if (rpc.Flat) {
+        rpc.Msg = camelCase(
+            v.name().substr(0, v.name().size() - flatSuffix.size()));
+      }
+      if (messages.count(rpc.Msg + "Req") == 0) {
+        continue;
+      }
+      rpc.OneWay = messages.count(rpc.Msg + "Rsp") == 0;
+      if (rpc.Flat && (flats.count(rpc.Msg + "Req") == 0 ||
+                       (!rpc.OneWay && flats.count(rpc.Msg + "Rsp") == 0))) {
+        fprintf(stderr, "%s:%d %s: %sReq/%sRsp has no flat form\n", __FILE__,
+                __LINE__, rpc.Cmd.c_str(), rpc.Msg.c_str(), rpc.Msg.c_str());
+        continue;
+      }
+      rpcs.push_back(rpc);
+    }
+  }
+  FILE *fp = fopen(argv[argi + 1], "w");
+  if (fp == nullptr) {
+    fprintf(stderr, "%s:%d open %s failed\n", __FILE__, __LINE__,
+            argv[argi + 1]);
+    return 1;
+  }
+  emit(fp, file, ns, rpcs);
+  fclose(fp);
+  return 0;
+}
@@ -0,0 +1,136 @@
+#include "rpcstats.h"
+
+#include <algorithm>
+#include <cstdio>
+
+static const unsigned int SUB_BITS = 5;
+static const uint64_t SUB_COUNT = 1 << SUB_BITS;
+// 超过2^37微秒的值记在最后一个桶
+static const unsigned int MAX_BIT = 37;
+static const size_t BUCKETS = (MAX_BIT - SUB_BITS + 2) * SUB_COUNT;
+
+LatencyHistogram::LatencyHistogram() : m_buckets(BUCKETS) {
+  m_count = 0;
+  m_sum = 0;
+  m_max = 0;
+}
+
+size_t LatencyHistogram::index(uint64_t us) {
+  if (us < SUB_COUNT) {
+    return size_t(us);
+  }
+  unsigned int msb = 63 - __builtin_clzll(us);
+  if (msb > MAX_BIT) {
+    return BUCKETS - 1;
+  }
+  // 最高位之后的SUB_BITS位决定子桶
+  unsigned int shift = msb - SUB_BITS;
+  return size_t((shift + 1) * SUB_COUNT + (us >> shift) - SUB_COUNT);
+}
+
+uint64_t LatencyHistogram::upper(size_t idx) {
+  if (idx < SUB_COUNT) {
+    return uint64_t(idx);
+  }
+  unsigned int shift = unsigned(idx / SUB_COUNT) - 1;
+  uint64_t sub = idx % SUB_COUNT + SUB_COUNT;
+  return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Record(uint64_t us) {
+  ++m_buckets[index(us)];
+  ++m_count;
+  m_sum += us;
+  m_max = std::max(m_max, us);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram &other) {
+  for (size_t i = 0; i < BUCKETS; i++) {
+    m_buckets[i] += other.m_buckets[i];
+  }
+  m_count += other.m_count;
+  m_sum += other.m_sum;
+  m_max = std::max(m_max, other.m_max);
+}
+
+void LatencyHistogram::Reset() {
+  std::fill(m_buckets.begin(), m_buckets.end(), 0);
+  m_count = 0;
+  m_sum = 0;
+  m_max = 0;
+}
+
+uint64_t LatencyHistogram::Percentile(double p) const {
+  if (m_count == 0) {
+    return 0;
+  }
+  uint64_t rank = uint64_t(p / 100 * m_count + 0.5);
+  rank = std::max<uint64_t>(1, std::min(rank, m_count));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < BUCKETS; i++) {
+    seen += m_buckets[i];
+    if (seen >= rank) {
+      return i == BUCKETS - 1 ? m_max : std::min(upper(i), m_max);
+    }
+  }
+  return m_max;
+}
+
+void CmdStats::Merge(const CmdStats &other) {
+  Requests += other.Requests;
+  Errors += other.Errors;
+  Timeouts += other.Timeouts;
+  Late += other.Late;
+  BytesOut += other.BytesOut;
+  BytesIn += other.BytesIn;
+  InFlight += other.InFlight;
+  Latency.Merge(other.Latency);
+}
+
+void RpcStats::Merge(const RpcStats &other) {
+  for (auto &v : other.m_cmds) {
+    m_cmds[v.first].Merge(v.second);
+  }
+}
+
+void RpcStats::Reset() {
+  for (auto &v : m_cmds) {
+    CmdStats &stats = v.second;
+    int64_t inflight = stats.InFlight;
+    stats.Requests = 0;
+    stats.Errors = 0;
+    stats.Timeouts = 0;
+    stats.Late = 0;
+    stats.BytesOut = 0;
+    stats.BytesIn = 0;
+    stats.InFlight = inflight;
+    stats.Latency.Reset();
+  }
+}
+
+std::string RpcStats::Dump() const {
+  std::vector<uint16_t> cmds;
+  for (auto &v : m_cmds) {
+    cmds.push_back(v.first);
+  }
+  std::sort(cmds.begin(), cmds.end());
+  std::string out;
+  char line[512];
+  for (auto cmd : cmds) {
+    const CmdStats &s = m_cmds.find(cmd)->second;
+    snprintf(line, sizeof(line),
+             "cmd:%u req:%llu err:%llu timeout:%llu late:%llu inflight:%lld "
+             "out:%llu in:%llu p50:%lluus p99:%lluus p999:%lluus "
+             "max:%lluus\n",
+             (unsigned int)cmd, (unsigned long long)s.Requests,
+             (unsigned long long)s.Errors, (unsigned long long)s.Timeouts,
+             (unsigned long long)s.Late, (long long)s.InFlight,
+             (unsigned long long)s.BytesOut, (unsigned long long)s.BytesIn,
+             (unsigned long long)s.Latency.Percentile(50),
+             (unsigned long long)s.Latency.Percentile(99),
+             (unsigned long long)s.Latency.Percentile(99.9),
+             (unsigned long long)s.Latency.Max());
+    out.append(line);
+  }
+  return out;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// 延迟直方图,HDR风格的对数线性分桶,单位微秒
+// 每个2的幂区间再等分为32个子桶,相对误差不超过1/32,最大约38小时
+class LatencyHistogram {
+ public:
+  LatencyHistogram();
+
+  void Record(uint64_t us);
+  void Merge(const LatencyHistogram &other);
+  void Reset();
+
+  uint64_t Count() const { return m_count; }
+  uint64_t Max() const { return m_max; }
+  double Mean() const { return m_count > 0 ? double(m_sum) / m_count : 0; }
+  // p取值0到100,返回所在桶的上界
+  uint64_t Percentile(double p) const;
+
+ private:
+  static size_t index(uint64_t us);
+  static uint64_t upper(size_t idx);
+
+ private:
+  std::vector<uint64_t> m_buckets;
+  uint64_t m_count;
+  uint64_t m_sum;
+  uint64_t m_max;
+};
+
+// 单个cmd的统计,请求数包含单向调用、对冲与重试发出的每一个请求
+struct CmdStats {
+  CmdStats()
+      : Requests(0),
+        Errors(0),
+        Timeouts(0),
+        Late(0),
+        BytesOut(0),
+        BytesIn(0),
+        InFlight(0) {}
+  void Merge(const CmdStats &other);
+  uint64_t Requests;
+  // 连接断开等错误导致失败的请求
+  uint64_t Errors;
+  uint64_t Timeouts;
+  // 超时或取消之后才到达的应答
+  uint64_t Late;
+  // 未压缩的包大小,包含包头
+  uint64_t BytesOut;
+  uint64_t BytesIn;
+  // 等待应答的请求数
+  int64_t InFlight;
+  // 从发出请求到收到应答(流式调用为结束帧)的时间
+  LatencyHistogram Latency;
+};
+
+// 一个事件循环内的rpc统计,只在所属线程中读写,不加锁
+// 多个循环的统计各自在所属线程中复制出来,再用Merge汇总
+class RpcStats {
+ public:
+  // 返回的引用在RpcStats销毁之前一直有效
+  CmdStats &Cmd(uint16_t cmd) { return m_cmds[cmd]; }
+  const std::unordered_map<uint16_t, CmdStats> &Cmds() const {
+    return m_cmds;
+  }
+  void Merge(const RpcStats &other);
+  // 清零计数与直方图,InFlight是当前值,保持不变
+  void Reset();
+  // 每个cmd一行的文本,按cmd排序
+  std::string Dump() const;
+
+ private:
+  std::unordered_map<uint16_t, CmdStats> m_cmds;
+};
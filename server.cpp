@@ -1,10 +1,23 @@
 #include "server.h"
 
+#include <fcntl.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <cstring>
 #include <iostream>
+#include <memory>
 
+#include "allocstat.h"
+#include "ctogo.pb.h"
+#include "goawait.h"
+#include "gochan.h"
+#include "gocompute.h"
+#include "gooffload.h"
+#include "gosync.h"
+#include "protorpcserver.h"
 #include "wrapsocket.h"
 
 const uint16_t port = 8888;
@@ -48,7 +61,8 @@ void Accept(GoContext &ctx) {
       continue;
     }
     std::cout << "accept a new connect" << std::endl;
-    ctx.GetEpoll()->Go(std::bind(NewConnect, std::placeholders::_1, newsocket));
+    ctx.GetEpoll()->Go(
+        [newsocket](GoContext &conn) { NewConnect(conn, newsocket); });
   }
 }
 
@@ -137,22 +151,687 @@ void Stat(GoContext &ctx) {
   }
 }
 
+ProtoRPCServer rpcserver;
+ErrNo OnQueryUserInfo(GoContext &ctx, const QueryUserInfoReq &req,
+                      QueryUserInfoRsp &rsp) {
+  rsp.set_username("iampsl");
+  rsp.set_password("fdfdfd");
+  rsp.set_money(100);
+  return 0;
+}
+ErrNo OnQueryUserInfoFlat(GoContext &ctx, const QueryUserInfoReqFlat &req,
+                          QueryUserInfoRspFlat &rsp) {
+  FlatStr username = req.username();
+  rsp.set_username(username.Data, username.Size);
+  rsp.set_password("fdfdfd");
+  rsp.set_money(100);
+  return 0;
+}
+
 GoRPC goclient;
+// 同样的请求分别用protobuf和flat格式往返,比较编解码的开销
+void TestFlatRpc(GoContext &ctx) {
+  const unsigned int num = 1000000;
+  QueryUserInfoReq req;
+  req.set_username("iampsl");
+  timespec begTime;
+  clock_gettime(CLOCK_REALTIME, &begTime);
+  for (unsigned int i = 0; i < num; i++) {
+    goclient.QueryUserInfo(&ctx, req);
+  }
+  timespec endTime;
+  clock_gettime(CLOCK_REALTIME, &endTime);
+  double protoTime = sub(&endTime, &begTime);
+  QueryUserInfoReqFlat flatReq;
+  flatReq.set_username("iampsl");
+  QueryUserInfoRspFlat flatRsp;
+  clock_gettime(CLOCK_REALTIME, &begTime);
+  for (unsigned int i = 0; i < num; i++) {
+    goclient.QueryUserInfoFlat(&ctx, flatReq, flatRsp);
+  }
+  clock_gettime(CLOCK_REALTIME, &endTime);
+  printf("protobuf:%f flat:%f\n", protoTime, sub(&endTime, &begTime));
+}
+
+// 大应答在tcp上压缩与不压缩的吞吐量,应答大小由请求的用户名指定
+// 模拟跨机器的带宽可以先限速,burst要大于lo的mtu(64k)否则大包会被一直丢弃
+// tc qdisc add dev lo root tbf rate 1gbit burst 1mb latency 50ms
+const uint16_t compressPort = 8889;
+ProtoRPCServer bigserver;
+GoRPC plainclient;
+GoRPC lz4client;
+std::string bigpayload;
+ErrNo OnQueryUserInfoLarge(GoContext &ctx, const QueryUserInfoReq &req,
+                           QueryUserInfoRsp &rsp) {
+  size_t size = strtoul(req.username().c_str(), nullptr, 10);
+  rsp.set_username(req.username());
+  rsp.set_password(bigpayload.data(), std::min(size, bigpayload.size()));
+  rsp.set_money(100);
+  return 0;
+}
+
+void TestCompress(GoContext &ctx) {
+  char record[128];
+  for (unsigned int i = 0; bigpayload.size() < 1024 * 1024; i++) {
+    snprintf(record, sizeof(record),
+             "{\"id\":%u,\"name\":\"user%u\",\"money\":%u},", i, i % 1000,
+             i * 7 % 10000);
+    bigpayload.append(record);
+  }
+  ctx.SleepMs(100);
+  const size_t sizes[] = {256, 4 * 1024, 64 * 1024, 1024 * 1024};
+  for (auto size : sizes) {
+    unsigned int num = (unsigned int)(std::max<size_t>(
+        200, std::min<size_t>(100000, 64 * 1024 * 1024 / size)));
+    QueryUserInfoReq req;
+    req.set_username(std::to_string(size));
+    double seconds[2];
+    GoRPC *clients[2] = {&plainclient, &lz4client};
+    for (int c = 0; c < 2; c++) {
+      timespec begTime;
+      clock_gettime(CLOCK_REALTIME, &begTime);
+      for (unsigned int i = 0; i < num; i++) {
+        clients[c]->QueryUserInfo(&ctx, req);
+      }
+      timespec endTime;
+      clock_gettime(CLOCK_REALTIME, &endTime);
+      seconds[c] = sub(&endTime, &begTime);
+    }
+    double mb = double(size) * num / (1024 * 1024);
+    printf("size:%lu plain:%.1fMB/s lz4:%.1fMB/s\n", (unsigned long int)size,
+           mb / seconds[0], mb / seconds[1]);
+  }
+}
+
+// 批量请求持续发送时交互请求的延迟
+// 依次为: 没有批量请求、同一连接不区分优先级、同一连接区分优先级、
+// 批量请求走单独的连接
+GoRPC sharedclient;
+GoRPC bulkclient;
+bool bulkRunning = false;
+unsigned int bulkWorkers = 0;
+void BulkLoad(GoContext &ctx, GoRPC *client, CallPriority priority) {
+  ++bulkWorkers;
+  QueryUserInfoReq req;
+  req.set_username(std::string(2 * 1024 * 1024, '0'));
+  while (bulkRunning) {
+    client->QueryUserInfo(&ctx, req, CALL_TIMEOUT_MS, priority);
+  }
+  --bulkWorkers;
+}
+
+void TestPriority(GoContext &ctx) {
+  const char *names[] = {"idle", "shared", "lane", "bulkconn"};
+  for (int mode = 0; mode < 4; mode++) {
+    GoRPC *client = mode == 3 ? &bulkclient : &sharedclient;
+    CallPriority priority = mode >= 2 ? PRIORITY_BULK : PRIORITY_INTERACTIVE;
+    bulkRunning = mode > 0;
+    for (int i = 0; bulkRunning && i < 4; i++) {
+      ctx.GetEpoll()->Go(std::bind(BulkLoad, std::placeholders::_1, client,
+                                   priority));
+    }
+    ctx.SleepMs(200);
+    QueryUserInfoReq req;
+    req.set_username("16");
+    LatencyHistogram hist;
+    for (int i = 0; i < 500; i++) {
+      uint64_t begin = curtimeus();
+      client->QueryUserInfo(&ctx, req);
+      hist.Record(curtimeus() - begin);
+    }
+    bulkRunning = false;
+    while (bulkWorkers > 0) {
+      ctx.SleepMs(10);
+    }
+    printf("priority %s p50:%lluus p99:%lluus\n", names[mode],
+           (unsigned long long)hist.Percentile(50),
+           (unsigned long long)hist.Percentile(99));
+  }
+}
+
+// 定时器轮的边界: 第1层当前槽在m_msNow停在64ms边界上时还没有降级
+// 在独立的Epoll上让一个定时器在边界前1ms到期,边界后11ms(第1层)和
+// 30ms(第0层)各有一个,11ms的那个不能晚到30ms才触发
+void TestTimer(GoContext &) {
+  Epoll e;
+  if (auto err = e.Create()) {
+    std::cout << strerror(err) << std::endl;
+    return;
+  }
+  unsigned int rounds = 0;
+  uint64_t maxLate = 0;
+  for (int i = 0; i < 8; i++) {
+    uint64_t now = curtimems();
+    uint64_t edge = (now | 63) + 65;
+    uint64_t due = edge + 11;
+    uint64_t fired = 0;
+    GoTimer late(&e);
+    late.Start(unsigned(due - now), [&fired]() { fired = curtimems(); });
+    GoTimer before(&e);
+    before.Start(unsigned(edge - 1 - now), []() {});
+    while (curtimems() < edge - 2) {
+      e.Wait(0);
+    }
+    if (curtimems() != edge - 2) {
+      continue;
+    }
+    GoTimer after(&e);
+    after.Start(30 + 2, []() {});
+    while (curtimems() < edge - 1) {
+    }
+    ++rounds;
+    while (fired == 0) {
+      e.Wait(100);
+    }
+    maxLate = std::max(maxLate, fired - due);
+  }
+  printf("timer edge rounds:%u maxlate:%lums\n", rounds,
+         (unsigned long)maxLate);
+}
+
+// 两个协程经GoChan轮流唤醒对方,每轮切入两次切出两次
+void TestSwitch(GoContext &ctx) {
+  const unsigned int num = 1000000;
+  GoChan ping(ctx.GetEpoll());
+  GoChan pong(ctx.GetEpoll());
+  ctx.GetEpoll()->Go([&](GoContext &peer) {
+    for (unsigned int i = 0; i < num; i++) {
+      ping.Wait(&peer);
+      pong.Wake();
+    }
+  });
+  ctx.SleepMs(1);
+  timespec begTime;
+  clock_gettime(CLOCK_REALTIME, &begTime);
+  for (unsigned int i = 0; i < num; i++) {
+    ping.Wake();
+    pong.Wait(&ctx);
+  }
+  timespec endTime;
+  clock_gettime(CLOCK_REALTIME, &endTime);
+  printf("switch:%.1fns\n", sub(&endTime, &begTime) * 1e9 / (4.0 * num));
+}
+
+// 创建、运行并结束协程的速率,每批1000个,栈从栈池中复用
+void TestSpawn(GoContext &ctx) {
+  const unsigned int num = 1000000;
+  const unsigned int batch = 1000;
+  WaitGroup wg;
+  unsigned int sum = 0;
+  AllocCounter allocs;
+  timespec begTime;
+  clock_gettime(CLOCK_REALTIME, &begTime);
+  for (unsigned int i = 0; i < num; i += batch) {
+    wg.Add(batch);
+    for (unsigned int j = 0; j < batch; j++) {
+      ctx.GetEpoll()->Go(
+          [&wg, &sum, j](GoContext &) {
+            sum += j;
+            wg.Done();
+          },
+          64 * 1024);
+    }
+    wg.Wait(&ctx);
+  }
+  timespec endTime;
+  clock_gettime(CLOCK_REALTIME, &endTime);
+  printf("spawn:%.2fM/s sum:%u", num / sub(&endTime, &begTime) / 1e6, sum);
+  if (AllocCounter::Enabled()) {
+    printf(" allocs/spawn:%f", double(allocs.Count()) / num);
+  }
+  printf("\n");
+}
+
+// 协程之间通过Chan传递消息的速率
+// pingpong为无缓冲通道上一问一答,stream为有缓冲通道上单向连续发送
+void TestChan(GoContext &ctx) {
+  const unsigned int num = 1000000;
+  Chan<unsigned int, 0> ping(ctx.GetEpoll());
+  Chan<unsigned int, 0> pong(ctx.GetEpoll());
+  Chan<unsigned int, 64> stream(ctx.GetEpoll());
+  GoChan done(ctx.GetEpoll());
+  ctx.GetEpoll()->Go([&](GoContext &peer) {
+    unsigned int v = 0;
+    while (ping.Recv(&peer, v) == 0) {
+      pong.Send(&peer, v);
+    }
+    while (stream.Recv(&peer, v) == 0) {
+    }
+    done.Wake();
+  });
+  AllocCounter allocs;
+  timespec begTime;
+  clock_gettime(CLOCK_REALTIME, &begTime);
+  for (unsigned int i = 0; i < num; i++) {
+    unsigned int v = 0;
+    ping.Send(&ctx, i);
+    pong.Recv(&ctx, v);
+  }
+  timespec endTime;
+  clock_gettime(CLOCK_REALTIME, &endTime);
+  double pingpong = num / sub(&endTime, &begTime);
+  ping.Close();
+  clock_gettime(CLOCK_REALTIME, &begTime);
+  for (unsigned int i = 0; i < num; i++) {
+    stream.Send(&ctx, i);
+  }
+  clock_gettime(CLOCK_REALTIME, &endTime);
+  double buffered = num / sub(&endTime, &begTime);
+  stream.Close();
+  done.Wait(&ctx);
+  printf("chan pingpong:%.0f/s stream:%.0f/s", pingpong, buffered);
+  if (AllocCounter::Enabled()) {
+    printf(" allocs/msg:%f", double(allocs.Count()) / (3 * num));
+  }
+  printf("\n");
+}
+
+// 扇出大量调用,信号量限制同时在途的请求数,WaitGroup等待全部完成
+void TestSync(GoContext &ctx) {
+  const unsigned int num = 100000;
+  const unsigned int limits[] = {1, 16, 256};
+  for (auto limit : limits) {
+    Semaphore sem(limit);
+    WaitGroup wg;
+    timespec begTime;
+    clock_gettime(CLOCK_REALTIME, &begTime);
+    for (unsigned int i = 0; i < num; i++) {
+      sem.Acquire(&ctx);
+      wg.Add(1);
+      ctx.GetEpoll()->Go(
+          [&sem, &wg](GoContext &ctx) {
+            GoRPC::ArenaScope arena(&goclient);
+            goclient.QueryUserInfo(&ctx, arena, "iampsl");
+            sem.Release();
+            wg.Done();
+          },
+          64 * 1024);
+    }
+    wg.Wait(&ctx);
+    timespec endTime;
+    clock_gettime(CLOCK_REALTIME, &endTime);
+    printf("fanout limit:%u calls/s:%.0f\n", limit,
+           num / sub(&endTime, &begTime));
+  }
+}
+
+// 每1ms醒来一次,记录两次醒来的最大间隔,反映Epoll被占用的时间
+class TickProbe {
+ public:
+  void Start(Epoll *e) {
+    m_running = true;
+    m_maxLate = 0;
+    m_done.Add(1);
+    e->Go(
+        [this](GoContext &tick) {
+          while (m_running) {
+            uint64_t beg = curtimeus();
+            tick.SleepMs(1);
+            uint64_t late = curtimeus() - beg;
+            if (late > m_maxLate) {
+              m_maxLate = late;
+            }
+          }
+          m_done.Done();
+        },
+        64 * 1024);
+  }
+  uint64_t Stop(GoContext *ctx) {
+    m_running = false;
+    m_done.Wait(ctx);
+    return m_maxLate;
+  }
+
+ private:
+  bool m_running;
+  uint64_t m_maxLate;
+  WaitGroup m_done;
+};
+
+uint64_t Burn(uint64_t x) {
+  for (unsigned int i = 0; i < 2000000; i++) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+  }
+  return x;
+}
+
+// CPU密集的协程在本线程执行与交给ComputePool执行,对比同一Epoll上1ms定时器的延迟
+void TestCompute(GoContext &ctx) {
+  const unsigned int jobs = 64;
+  ComputePool pool(std::thread::hardware_concurrency());
+  if (auto err = pool.Start()) {
+    std::cout << strerror(err) << std::endl;
+    return;
+  }
+  for (int mode = 0; mode < 2; mode++) {
+    uint64_t sum = 0;
+    TickProbe probe;
+    probe.Start(ctx.GetEpoll());
+    WaitGroup wg;
+    wg.Add(jobs);
+    timespec begTime;
+    clock_gettime(CLOCK_REALTIME, &begTime);
+    for (unsigned int i = 0; i < jobs; i++) {
+      ctx.GetEpoll()->Go(
+          [&, i](GoContext &job) {
+            uint64_t r = 0;
+            if (mode == 0) {
+              r = Burn(i);
+            } else {
+              GoCompute(pool, &job, [&]() { r = Burn(i); });
+            }
+            sum += r;
+            wg.Done();
+          },
+          64 * 1024);
+    }
+    wg.Wait(&ctx);
+    timespec endTime;
+    clock_gettime(CLOCK_REALTIME, &endTime);
+    uint64_t maxLate = probe.Stop(&ctx);
+    printf("compute %s time:%f maxtick:%.1fms steals:%lu sum:%lu\n",
+           mode == 0 ? "inline" : "pool", sub(&endTime, &begTime),
+           maxLate / 1000.0, pool.Steals(), sum);
+  }
+}
+
+// 模拟慢磁盘调用,直接在协程中调用与通过Offload调用时1ms定时器的最大延迟
+void TestOffload(GoContext &ctx) {
+  const unsigned int jobs = 16;
+  OffloadPool pool(4, 1024);
+  if (auto err = pool.Start()) {
+    std::cout << strerror(err) << std::endl;
+    return;
+  }
+  ctx.GetEpoll()->SetOffloadPool(&pool);
+  for (int mode = 0; mode < 2; mode++) {
+    TickProbe probe;
+    probe.Start(ctx.GetEpoll());
+    WaitGroup wg;
+    wg.Add(jobs);
+    timespec begTime;
+    clock_gettime(CLOCK_REALTIME, &begTime);
+    for (unsigned int i = 0; i < jobs; i++) {
+      ctx.GetEpoll()->Go(
+          [&](GoContext &job) {
+            for (int k = 0; k < 5; k++) {
+              if (mode == 0) {
+                usleep(10000);
+              } else if (auto err = job.Offload([]() { usleep(10000); })) {
+                std::cout << strerror(err) << std::endl;
+              }
+            }
+            wg.Done();
+          },
+          64 * 1024);
+    }
+    wg.Wait(&ctx);
+    timespec endTime;
+    clock_gettime(CLOCK_REALTIME, &endTime);
+    uint64_t maxLate = probe.Stop(&ctx);
+    OffloadStats stats = pool.Stats();
+    printf(
+        "offload %s time:%f maxtick:%.1fms maxqueued:%zu completed:%lu "
+        "avgqueue:%.1fms\n",
+        mode == 0 ? "inline" : "pool", sub(&endTime, &begTime),
+        maxLate / 1000.0, stats.MaxQueued, stats.Completed,
+        stats.Completed == 0 ? 0.0
+                             : stats.QueueUs / 1000.0 / stats.Completed);
+  }
+  ctx.GetEpoll()->SetOffloadPool(nullptr);
+}
+
+// 64个协程并发追加4KB记录并要求落盘,组提交把它们合并成少量的write和fdatasync
+void TestFile(GoContext &ctx) {
+  const unsigned int writers = 64;
+  const unsigned int records = 100;
+  OffloadPool pool(4, 1024);
+  if (auto err = pool.Start()) {
+    std::cout << strerror(err) << std::endl;
+    return;
+  }
+  ctx.GetEpoll()->SetOffloadPool(&pool);
+  const char *path = "/tmp/goserver_append.log";
+  AsyncFile file;
+  if (auto err = file.Open(path, O_WRONLY | O_CREAT | O_TRUNC)) {
+    std::cout << strerror(err) << std::endl;
+    ctx.GetEpoll()->SetOffloadPool(nullptr);
+    return;
+  }
+  WaitGroup wg;
+  wg.Add(writers);
+  timespec begTime;
+  clock_gettime(CLOCK_REALTIME, &begTime);
+  for (unsigned int i = 0; i < writers; i++) {
+    ctx.GetEpoll()->Go(
+        [&](GoContext &writer) {
+          char record[4096];
+          memset(record, 'a', sizeof(record));
+          for (unsigned int k = 0; k < records; k++) {
+            if (auto err = file.Append(&writer, record, sizeof(record), true)) {
+              std::cout << strerror(err) << std::endl;
+              break;
+            }
+          }
+          wg.Done();
+        },
+        64 * 1024);
+  }
+  wg.Wait(&ctx);
+  timespec endTime;
+  clock_gettime(CLOCK_REALTIME, &endTime);
+  double t = sub(&endTime, &begTime);
+  printf("append %.1fMB/s records/s:%.0f writes:%lu syncs:%lu\n",
+         writers * records * 4096.0 / t / 1e6, writers * records / t,
+         file.AppendWrites(), file.AppendSyncs());
+  file.Close();
+  unlink(path);
+  ctx.GetEpoll()->SetOffloadPool(nullptr);
+}
+
+/*
+  两个协程通过GoChan不停地互相唤醒,运行队列永远不空
+  不设预算时整个期间Epoll不返回,设置SetRunBudget后每轮最多执行1ms
+  后台协程循环计算并Yield,只占用普通队列剩下的时间
+*/
+void TestYield(GoContext &ctx) {
+  Epoll *e = ctx.GetEpoll();
+  for (int mode = 0; mode < 2; mode++) {
+    if (mode == 1) {
+      e->SetRunBudget(0, 1000);
+    }
+    TickProbe probe;
+    probe.Start(e);
+    bool running = true;
+    uint64_t rounds = 0;
+    WaitGroup wg;
+    wg.Add(2);
+    GoChan ping(e);
+    GoChan pong(e);
+    e->Go(
+        [&](GoContext &peer) {
+          while (running) {
+            ping.Wait(&peer);
+            pong.Wake();
+          }
+          wg.Done();
+        },
+        64 * 1024);
+    e->Go(
+        [&](GoContext &busy) {
+          uint64_t beg = curtimeus();
+          while (curtimeus() - beg < 200000) {
+            ping.Wake();
+            pong.Wait(&busy);
+            ++rounds;
+          }
+          running = false;
+          ping.Wake();
+          wg.Done();
+        },
+        64 * 1024);
+    wg.Wait(&ctx);
+    uint64_t maxLate = probe.Stop(&ctx);
+    printf("yield %s rounds:%lu maxtick:%.1fms\n",
+           mode == 0 ? "nobudget" : "budget1ms", rounds, maxLate / 1000.0);
+  }
+  // 后台协程每算一小段就Yield
+  TickProbe probe;
+  probe.Start(e);
+  WaitGroup wg;
+  wg.Add(1);
+  uint64_t slices = 0;
+  e->Go(
+      [&](GoContext &bg) {
+        bg.SetBackground(true);
+        uint64_t beg = curtimeus();
+        uint64_t x = 0;
+        while (curtimeus() - beg < 200000) {
+          for (int i = 0; i < 10000; i++) {
+            x = x * 6364136223846793005ULL + 1;
+          }
+          ++slices;
+          bg.Yield();
+        }
+        wg.Done();
+      },
+      64 * 1024);
+  wg.Wait(&ctx);
+  uint64_t maxLate = probe.Stop(&ctx);
+  printf("yield background slices:%lu maxtick:%.1fms\n", slices,
+         maxLate / 1000.0);
+  e->SetRunBudget(0, 0);
+}
+
+// 无栈协程版本的NewConnect,读出的数据立即写回,缓冲区在各连接之间共用
+uint8_t asyncBuffer[10240];
+AsyncTask AsyncEcho(Epoll *e, int s) {
+  TcpSocket ptcp(e);
+  if (auto err = ptcp.Open(s)) {
+    std::cout << strerror(err) << std::endl;
+    co_return;
+  }
+  while (true) {
+    auto [nread, err] =
+        co_await AsyncRead(ptcp, asyncBuffer, sizeof(asyncBuffer));
+    if (err != 0 || nread == 0) {
+      co_return;
+    }
+    ptcp.Write(asyncBuffer, nread);
+  }
+}
+
+// 只提供GoContext接口的rpc调用通过AsyncGo借用一个临时的栈
+AsyncTask AsyncQuery(Epoll *e, WaitGroup *wg) {
+  co_await AsyncSleep(e, 1);
+  uint32_t money = 0;
+  ErrNo err = 0;
+  co_await AsyncGo(e, [&money, &err](GoContext &ctx) {
+    GoRPC::ArenaScope arena(&goclient);
+    QueryUserInfoRsp *rsp = nullptr;
+    std::tie(rsp, err) = goclient.QueryUserInfo(&ctx, arena, "iampsl");
+    money = rsp->money();
+  });
+  if (err != 0 || money != 100) {
+    fprintf(stderr, "%s:%d async query failed errno=%d\n", __FILE__,
+            __LINE__, int(err));
+  }
+  wg->Done();
+}
+
+// 每条连接一个无栈协程,统计每条连接的协程帧大小
+void TestAwait(GoContext &ctx) {
+  const unsigned int num = 1000;
+  Epoll *e = ctx.GetEpoll();
+  size_t begBytes = FrameBytes();
+  std::vector<std::unique_ptr<TcpSocket>> clients;
+  for (unsigned int i = 0; i < num; i++) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+      break;
+    }
+    GoAsync(e, AsyncEcho(e, sv[0]));
+    clients.emplace_back(new TcpSocket(e));
+    clients.back()->Open(sv[1]);
+  }
+  size_t frameBytes = FrameBytes() - begBytes;
+  unsigned int echoed = 0;
+  for (auto &c : clients) {
+    char buf[4];
+    c->Write("ping", sizeof(buf));
+    size_t nread = 0;
+    ErrNo err = 0;
+    std::tie(nread, err) = c->Read(&ctx, buf, sizeof(buf));
+    if (err == 0 && nread == sizeof(buf)) {
+      ++echoed;
+    }
+  }
+  size_t conns = clients.size();
+  clients.clear();
+  WaitGroup wg;
+  wg.Add(1);
+  GoAsync(e, AsyncQuery(e, &wg));
+  wg.Wait(&ctx);
+  printf("await conns:%lu echoed:%u frame bytes/conn:%lu\n",
+         (unsigned long int)conns, echoed,
+         (unsigned long int)(conns > 0 ? frameBytes / conns : 0));
+}
+
 void TestRpc(GoContext &ctx) {
   std::string username("iampsl");
+  const unsigned int num = 1000000;
   timespec begTime;
   clock_gettime(CLOCK_REALTIME, &begTime);
-  for (unsigned int i = 0; i < 1000000; i++) {
-    goclient.QueryUserInfo(&ctx, username);
+  AllocCounter allocs;
+  for (unsigned int i = 0; i < num; i++) {
+    GoRPC::ArenaScope arena(&goclient);
+    goclient.QueryUserInfo(&ctx, arena, username);
   }
   timespec endTime;
   clock_gettime(CLOCK_REALTIME, &endTime);
-  printf("time:%f\n", sub(&endTime, &begTime));
+  printf("time:%f", sub(&endTime, &begTime));
+  if (AllocCounter::Enabled()) {
+    printf(" allocs/call:%f", double(allocs.Count()) / num);
+  }
+  printf("\n");
+  printf("%s", goclient.GetStats().Dump().c_str());
+  TestFlatRpc(ctx);
+  TestCompress(ctx);
+  TestPriority(ctx);
+  TestTimer(ctx);
+  TestSwitch(ctx);
+  TestSpawn(ctx);
+  TestYield(ctx);
+  TestChan(ctx);
+  TestSync(ctx);
+  TestCompute(ctx);
+  TestOffload(ctx);
+  TestFile(ctx);
+  TestAwait(ctx);
 }
 
 void server::Start(int num) {
   m_epoll.Create();
   // m_epoll.Go(Accept);
+  unlink("/test.sock");
+  RegisterCtogo<QUERY_USER_INFO>(rpcserver, OnQueryUserInfo);
+  RegisterCtogo<QUERY_USER_INFO_FLAT>(rpcserver, OnQueryUserInfoFlat);
+  if (auto err = rpcserver.Start(&m_epoll, "/test.sock")) {
+    std::cout << strerror(err) << std::endl;
+    return;
+  }
+  RegisterCtogo<QUERY_USER_INFO>(bigserver, OnQueryUserInfoLarge);
+  if (auto err = bigserver.Start(&m_epoll, "127.0.0.1", compressPort)) {
+    std::cout << strerror(err) << std::endl;
+    return;
+  }
+  plainclient.Start(&m_epoll, "127.0.0.1", compressPort);
+  lz4client.EnableCompress(1024);
+  lz4client.Start(&m_epoll, "127.0.0.1", compressPort);
+  sharedclient.Start(&m_epoll, "127.0.0.1", compressPort);
+  bulkclient.SetBulkConnections(1);
+  bulkclient.Start(&m_epoll, "127.0.0.1", compressPort);
+  goclient.EnableShm(1024 * 1024);
   goclient.Start(&m_epoll, "/test.sock");
   for (int i = 0; i < 1; i++) {
     m_epoll.Go(TestRpc);
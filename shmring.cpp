@@ -0,0 +1,334 @@
+#include "shmring.h"
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+/*
+  共享内存布局
+  |控制页|环0数据|环1数据|
+  控制页  两个ShmRingHead,环0由发起方写,环1由接收方写
+  门铃    fds[1]通知环0的读者(接收方),fds[2]通知环1的读者(发起方)
+          读者取走数据时如果写者在等空间,也按写者这一端的门铃
+*/
+
+// 大小固定且不能再改封印,对端无法截断共享内存让我们访问映射时收到SIGBUS
+static const int SHM_SEALS = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+
+static size_t pageSize() { return size_t(sysconf(_SC_PAGESIZE)); }
+
+static void closeFd(int fd) {
+  if (fd != -1 && close(fd) != 0) {
+    fprintf(stderr, "%s:%d errno=%d\n", __FILE__, __LINE__, int(errno));
+  }
+}
+
+ShmChannel::ShmChannel(Epoll *e) : m_recvEvent(e) {
+  m_epoll = e;
+  m_bellWaiting = false;
+  m_memfd = -1;
+  m_sendEventFd = -1;
+  m_capacity = 0;
+  m_ctrl = nullptr;
+  m_data[0] = nullptr;
+  m_data[1] = nullptr;
+  m_send = nullptr;
+  m_recv = nullptr;
+  m_sendData = nullptr;
+  m_recvData = nullptr;
+  m_closed = false;
+}
+
+ShmChannel::~ShmChannel() {
+  Close();
+  unmap();
+}
+
+ErrNo ShmChannel::Create(size_t capacity, int fds[3]) {
+  size_t page = pageSize();
+  size_t cap = page;
+  while (cap < capacity) {
+    cap <<= 1;
+  }
+  int memfd = memfd_create("protorpc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (memfd == -1) {
+    return errno;
+  }
+  if (ftruncate(memfd, off_t(page + cap * 2)) != 0 ||
+      fcntl(memfd, F_ADD_SEALS, SHM_SEALS) != 0) {
+    int err = errno;
+    closeFd(memfd);
+    return err;
+  }
+  ErrNo err = mapRings(memfd, cap);
+  if (err) {
+    closeFd(memfd);
+    return err;
+  }
+  new (m_send) ShmRingHead();
+  new (m_recv) ShmRingHead();
+  int efd0 = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (efd0 == -1) {
+    err = errno;
+    closeFd(memfd);
+    unmap();
+    return err;
+  }
+  err = m_recvEvent.Open();
+  if (err) {
+    closeFd(memfd);
+    closeFd(efd0);
+    unmap();
+    return err;
+  }
+  m_memfd = memfd;
+  m_sendEventFd = efd0;
+  fds[0] = memfd;
+  fds[1] = efd0;
+  fds[2] = m_recvEvent.Fd();
+  return 0;
+}
+
+ErrNo ShmChannel::Attach(const int fds[3]) {
+  int seals = fcntl(fds[0], F_GET_SEALS);
+  if (seals == -1 || (seals & SHM_SEALS) != SHM_SEALS) {
+    fprintf(stderr, "%s:%d shm not sealed seals=%d\n", __FILE__, __LINE__,
+            seals);
+    for (int i = 0; i < 3; i++) {
+      closeFd(fds[i]);
+    }
+    return EPERM;
+  }
+  struct stat st;
+  if (fstat(fds[0], &st) != 0) {
+    int err = errno;
+    for (int i = 0; i < 3; i++) {
+      closeFd(fds[i]);
+    }
+    return err;
+  }
+  size_t page = pageSize();
+  size_t total = size_t(st.st_size);
+  size_t cap = total > page ? (total - page) / 2 : 0;
+  if (cap < page || (cap & (cap - 1)) != 0 || page + cap * 2 != total) {
+    for (int i = 0; i < 3; i++) {
+      closeFd(fds[i]);
+    }
+    return EINVAL;
+  }
+  ErrNo err = mapRings(fds[0], cap);
+  closeFd(fds[0]);
+  if (err) {
+    closeFd(fds[1]);
+    closeFd(fds[2]);
+    return err;
+  }
+  std::swap(m_send, m_recv);
+  std::swap(m_sendData, m_recvData);
+  err = m_recvEvent.Open(fds[1]);
+  if (err) {
+    closeFd(fds[2]);
+    unmap();
+    return err;
+  }
+  m_sendEventFd = fds[2];
+  return 0;
+}
+
+ErrNo ShmChannel::mapRings(int memfd, size_t capacity) {
+  size_t page = pageSize();
+  m_ctrl = mmap(nullptr, page, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (m_ctrl == MAP_FAILED) {
+    m_ctrl = nullptr;
+    return errno;
+  }
+  m_capacity = capacity;
+  for (int i = 0; i < 2; i++) {
+    void *base = mmap(nullptr, capacity * 2, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+      int err = errno;
+      unmap();
+      return err;
+    }
+    m_data[i] = (uint8_t *)base;
+    off_t offset = off_t(page + capacity * i);
+    for (int j = 0; j < 2; j++) {
+      void *p = mmap((uint8_t *)base + capacity * j, capacity,
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memfd,
+                     offset);
+      if (p == MAP_FAILED) {
+        int err = errno;
+        unmap();
+        return err;
+      }
+    }
+  }
+  m_send = (ShmRingHead *)m_ctrl;
+  m_recv = m_send + 1;
+  m_sendData = m_data[0];
+  m_recvData = m_data[1];
+  return 0;
+}
+
+void ShmChannel::unmap() {
+  for (int i = 0; i < 2; i++) {
+    if (m_data[i] != nullptr) {
+      munmap(m_data[i], m_capacity * 2);
+      m_data[i] = nullptr;
+    }
+  }
+  if (m_ctrl != nullptr) {
+    munmap(m_ctrl, pageSize());
+    m_ctrl = nullptr;
+  }
+  m_send = nullptr;
+  m_recv = nullptr;
+  m_sendData = nullptr;
+  m_recvData = nullptr;
+}
+
+bool ShmChannel::Send(const void *pdata, size_t size) {
+  if (m_closed || m_send == nullptr) {
+    return false;
+  }
+  uint64_t head = m_send->Head.load(std::memory_order_relaxed);
+  uint64_t tail = m_send->Tail.load(std::memory_order_acquire);
+  // 控制页对端可写,读写位置不合法时关闭通道
+  if (head - tail > m_capacity) {
+    fprintf(stderr, "%s:%d bad shm ring head:%lu tail:%lu\n", __FILE__,
+            __LINE__, (unsigned long int)head, (unsigned long int)tail);
+    Close();
+    return false;
+  }
+  if (m_capacity - (head - tail) < size) {
+    return false;
+  }
+  memcpy(m_sendData + (head & (m_capacity - 1)), pdata, size);
+  m_send->Head.store(head + size, std::memory_order_release);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (m_send->Sleeping.load(std::memory_order_relaxed) != 0 &&
+      m_send->Sleeping.exchange(0) != 0) {
+    uint64_t value = 1;
+    if (write(m_sendEventFd, &value, sizeof(value)) != sizeof(value)) {
+      fprintf(stderr, "%s:%d errno=%d\n", __FILE__, __LINE__, int(errno));
+    }
+  }
+  return true;
+}
+
+bool ShmChannel::Drained() {
+  if (m_closed || m_send == nullptr) {
+    return true;
+  }
+  return m_send->Tail.load(std::memory_order_acquire) ==
+         m_send->Head.load(std::memory_order_relaxed);
+}
+
+ErrNo ShmChannel::WaitSpace(GoContext *ctx, size_t size) {
+  size = std::min(size, m_capacity);
+  while (true) {
+    if (m_closed || m_send == nullptr) {
+      return EPIPE;
+    }
+    uint64_t head = m_send->Head.load(std::memory_order_relaxed);
+    uint64_t tail = m_send->Tail.load(std::memory_order_acquire);
+    if (head - tail > m_capacity) {
+      fprintf(stderr, "%s:%d bad shm ring head:%lu tail:%lu\n", __FILE__,
+              __LINE__, (unsigned long int)head, (unsigned long int)tail);
+      Close();
+      return EPROTO;
+    }
+    if (m_capacity - (head - tail) >= size) {
+      return 0;
+    }
+    m_send->Full.store(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_send->Tail.load(std::memory_order_acquire) != tail) {
+      m_send->Full.store(0, std::memory_order_relaxed);
+      continue;
+    }
+    if (ErrNo err = waitBell(ctx)) {
+      return err;
+    }
+  }
+}
+
+ErrNo ShmChannel::waitBell(GoContext *ctx) {
+  if (m_bellWaiting) {
+    m_bellWaits.Wait(ctx);
+    return m_closed ? EPIPE : 0;
+  }
+  m_bellWaiting = true;
+  ErrNo err = m_recvEvent.Wait(ctx);
+  m_bellWaiting = false;
+  // 门铃不区分数据和空间,排队的协程各自重新检查
+  m_bellWaits.WakeAll();
+  return err;
+}
+
+std::tuple<const uint8_t *, size_t, ErrNo> ShmChannel::Peek(GoContext *ctx) {
+  while (true) {
+    if (m_closed || m_recv == nullptr) {
+      return std::make_tuple<const uint8_t *, size_t, ErrNo>(nullptr, 0,
+                                                             ErrNo(EPIPE));
+    }
+    uint64_t tail = m_recv->Tail.load(std::memory_order_relaxed);
+    uint64_t head = m_recv->Head.load(std::memory_order_acquire);
+    if (head - tail > m_capacity) {
+      fprintf(stderr, "%s:%d bad shm ring head:%lu tail:%lu\n", __FILE__,
+              __LINE__, (unsigned long int)head, (unsigned long int)tail);
+      Close();
+      return std::make_tuple<const uint8_t *, size_t, ErrNo>(nullptr, 0,
+                                                             ErrNo(EPROTO));
+    }
+    if (head != tail) {
+      return std::make_tuple<const uint8_t *, size_t, ErrNo>(
+          m_recvData + (tail & (m_capacity - 1)), size_t(head - tail), 0);
+    }
+    m_recv->Sleeping.store(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_recv->Head.load(std::memory_order_acquire) != tail) {
+      m_recv->Sleeping.store(0, std::memory_order_relaxed);
+      continue;
+    }
+    ErrNo err = waitBell(ctx);
+    if (err) {
+      return std::make_tuple<const uint8_t *, size_t, ErrNo>(nullptr, 0,
+                                                             ErrNo(err));
+    }
+  }
+}
+
+void ShmChannel::Consume(size_t size) {
+  uint64_t tail = m_recv->Tail.load(std::memory_order_relaxed);
+  m_recv->Tail.store(tail + size, std::memory_order_release);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (m_recv->Full.load(std::memory_order_relaxed) != 0 &&
+      m_recv->Full.exchange(0) != 0 && m_sendEventFd != -1) {
+    uint64_t value = 1;
+    if (write(m_sendEventFd, &value, sizeof(value)) != sizeof(value)) {
+      fprintf(stderr, "%s:%d errno=%d\n", __FILE__, __LINE__, int(errno));
+    }
+  }
+}
+
+void ShmChannel::Close() {
+  if (m_closed) {
+    return;
+  }
+  m_closed = true;
+  m_recvEvent.Close();
+  closeFd(m_memfd);
+  m_memfd = -1;
+  closeFd(m_sendEventFd);
+  m_sendEventFd = -1;
+}
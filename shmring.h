@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+
+#include "gosync.h"
+#include "wrapsocket.h"
+
+// 单生产者单消费者环形缓冲区的控制头,位于共享内存中
+struct ShmRingHead {
+  std::atomic<uint64_t> Head;
+  char Pad1[56];
+  std::atomic<uint64_t> Tail;
+  // 读者等待数据
+  std::atomic<uint32_t> Sleeping;
+  // 写者等待空间,读者取走数据后按门铃
+  std::atomic<uint32_t> Full;
+  char Pad2[48];
+};
+
+// 基于memfd的双向共享内存通道,每个方向一个环,eventfd作为门铃
+// 环的数据区连续映射两次,跨越环尾的帧在地址上仍然连续
+class ShmChannel {
+ public:
+  ShmChannel(Epoll *e);
+  ShmChannel(const ShmChannel &) = delete;
+  ShmChannel &operator=(const ShmChannel &) = delete;
+  ~ShmChannel();
+
+  // 发起方创建共享内存和门铃,fds为需要传给对端的3个描述符,仍归通道所有
+  // 共享内存创建后即封印大小
+  ErrNo Create(size_t capacity, int fds[3]);
+  // 接收方用对端传来的描述符建立通道,描述符所有权转移给通道
+  // 共享内存没有封印大小时拒绝
+  ErrNo Attach(const int fds[3]);
+  // 写入若干完整的帧,空间不足返回false,由调用者改走socket
+  bool Send(const void *pdata, size_t size);
+  // 发出的数据已全部被对端取走,通道关闭后也返回true
+  bool Drained();
+  // 等待环中至少有size字节的空闲,size超过容量时等待环被取空
+  // 通道关闭返回EPIPE
+  ErrNo WaitSpace(GoContext *ctx, size_t size);
+  size_t Capacity() const { return m_capacity; }
+  // 等待对端写入,返回连续可读的数据,处理后调用Consume
+  // 对端写坏了读写位置时关闭通道,返回EPROTO
+  // 映射在析构时才解除,Close之后已取得的数据仍可访问
+  std::tuple<const uint8_t *, size_t, ErrNo> Peek(GoContext *ctx);
+  void Consume(size_t size);
+  void Close();
+
+ private:
+  ErrNo mapRings(int memfd, size_t capacity);
+  void unmap();
+  // 等数据和等空间的协程共用本端的门铃,一个在eventfd上等,其余排队
+  ErrNo waitBell(GoContext *ctx);
+
+ private:
+  Epoll *m_epoll;
+  EventFd m_recvEvent;
+  bool m_bellWaiting;
+  GoWaitList m_bellWaits;
+  int m_memfd;
+  int m_sendEventFd;
+  size_t m_capacity;
+  void *m_ctrl;
+  uint8_t *m_data[2];
+  ShmRingHead *m_send;
+  ShmRingHead *m_recv;
+  uint8_t *m_sendData;
+  uint8_t *m_recvData;
+  bool m_closed;
+};
@@ -2,6 +2,7 @@
 
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
@@ -39,6 +40,7 @@ AcceptSocket::AcceptSocket(Epoll *e) {
   m_epoll = e;
   m_fd = -1;
   m_inWait = nullptr;
+  m_inAsync = nullptr;
 }
 
 AcceptSocket::~AcceptSocket() { Close(); }
@@ -170,6 +172,11 @@ void AcceptSocket::Close() {
     ErrorInfo(errno);
   }
   m_fd = -1;
+  if (m_inAsync != nullptr) {
+    AsyncWaiter *tmpAsync = m_inAsync;
+    m_inAsync = nullptr;
+    m_epoll->push([tmpAsync]() { tmpAsync->OnReady(); });
+  }
   if (m_inWait == nullptr) {
     return;
   }
@@ -179,6 +186,12 @@ void AcceptSocket::Close() {
 }
 
 void AcceptSocket::OnIn() {
+  if (m_inAsync != nullptr) {
+    AsyncWaiter *tmpAsync = m_inAsync;
+    m_inAsync = nullptr;
+    tmpAsync->OnReady();
+    return;
+  }
   if (m_inWait == nullptr) {
     return;
   }
@@ -193,8 +206,14 @@ TcpSocket::TcpSocket(Epoll *e) {
   m_epoll = e;
   m_inWait = nullptr;
   m_connWait = nullptr;
+  m_inAsync = nullptr;
+  m_inSel = nullptr;
+  m_inIndex = 0;
   m_fd = -1;
   m_sendFail = false;
+  m_writeHead = 0;
+  m_bulkHead = 0;
+  m_bulkCut = false;
 }
 
 TcpSocket::~TcpSocket() { Close(); }
@@ -350,29 +369,71 @@ void TcpSocket::Write(const void *buf, size_t nbytes) {
     return;
   }
   auto len = m_writeBuffer.size();
-  if (len != 0) {
+  if (len != 0 || m_bulkCut) {
     m_writeBuffer.resize(len + nbytes);
     memcpy(&(m_writeBuffer[len]), buf, nbytes);
     return;
   }
+  size_t total = sendSome((const uint8_t *)buf, nbytes);
+  if (total == nbytes || m_sendFail) {
+    return;
+  }
+  m_writeBuffer.resize(nbytes - total);
+  memcpy(&(m_writeBuffer[0]), (uint8_t *)buf + total, nbytes - total);
+}
+
+void TcpSocket::WriteBulk(const void *buf, size_t nbytes) {
+  if (m_sendFail) {
+    return;
+  }
+  if (nbytes == 0 || buf == nullptr) {
+    return;
+  }
+  size_t total = 0;
+  if (m_writeBuffer.empty() && m_bulkBuffer.empty()) {
+    total = sendSome((const uint8_t *)buf, nbytes);
+    if (total == nbytes || m_sendFail) {
+      return;
+    }
+    m_bulkCut = total > 0;
+  }
+  auto len = m_bulkBuffer.size();
+  m_bulkBuffer.resize(len + nbytes - total);
+  memcpy(&(m_bulkBuffer[len]), (uint8_t *)buf + total, nbytes - total);
+  m_bulkUnits.push_back(nbytes - total);
+}
+
+// 已发出的前缀超过一半时才前移剩余数据,积压很多时部分发送不会反复搬动整个缓冲区
+static void dropSent(std::vector<uint8_t> &buffer, size_t &head,
+                     size_t sent) {
+  head += sent;
+  if (head == buffer.size()) {
+    buffer.clear();
+    head = 0;
+    return;
+  }
+  if (head * 2 < buffer.size()) {
+    return;
+  }
+  memmove(&(buffer[0]), &(buffer[head]), buffer.size() - head);
+  buffer.resize(buffer.size() - head);
+  head = 0;
+}
+
+size_t TcpSocket::sendSome(const uint8_t *buf, size_t nbytes) {
   size_t total = 0;
   while (total != nbytes) {
-    auto isend = send(m_fd, (uint8_t *)buf + total, nbytes - total, 0);
+    auto isend = send(m_fd, buf + total, nbytes - total, 0);
     if (isend >= 0) {
       total += isend;
       continue;
     }
     if (errno != EAGAIN) {
       m_sendFail = true;
-      return;
     }
     break;
   }
-  if (total == nbytes) {
-    return;
-  }
-  m_writeBuffer.resize(nbytes - total);
-  memcpy(&(m_writeBuffer[0]), (uint8_t *)buf + total, nbytes - total);
+  return total;
 }
 
 std::tuple<size_t, ErrNo> TcpSocket::Read(GoContext *ctx, void *buf,
@@ -391,6 +452,87 @@ std::tuple<size_t, ErrNo> TcpSocket::Read(GoContext *ctx, void *buf,
   }
 }
 
+ErrNo TcpSocket::WriteFds(const void *buf, size_t nbytes, const int *fds,
+                         int nfds) {
+  if (m_fd == -1) {
+    return EBADF;
+  }
+  if (m_sendFail) {
+    return EPIPE;
+  }
+  if (!m_writeBuffer.empty() || !m_bulkBuffer.empty()) {
+    return EAGAIN;
+  }
+  if (nbytes == 0 || buf == nullptr || nfds <= 0) {
+    return EINVAL;
+  }
+  iovec iov;
+  iov.iov_base = const_cast<void *>(buf);
+  iov.iov_len = nbytes;
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * nfds));
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = &(control[0]);
+  msg.msg_controllen = control.size();
+  cmsghdr *pcmsg = CMSG_FIRSTHDR(&msg);
+  pcmsg->cmsg_level = SOL_SOCKET;
+  pcmsg->cmsg_type = SCM_RIGHTS;
+  pcmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+  memcpy(CMSG_DATA(pcmsg), fds, sizeof(int) * nfds);
+  auto isend = sendmsg(m_fd, &msg, 0);
+  if (isend < 0) {
+    return errno;
+  }
+  Write((const uint8_t *)buf + isend, nbytes - isend);
+  return 0;
+}
+
+std::tuple<size_t, ErrNo> TcpSocket::ReadFds(GoContext *ctx, void *buf,
+                                             size_t nbytes, int *fds,
+                                             int &nfds) {
+  int maxfds = nfds;
+  nfds = 0;
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * (maxfds > 0 ? maxfds : 1)));
+  while (true) {
+    iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = nbytes;
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &(control[0]);
+    msg.msg_controllen = control.size();
+    auto irecv = recvmsg(m_fd, &msg, MSG_CMSG_CLOEXEC);
+    if (irecv >= 0) {
+      for (cmsghdr *pcmsg = CMSG_FIRSTHDR(&msg); pcmsg != nullptr;
+           pcmsg = CMSG_NXTHDR(&msg, pcmsg)) {
+        if (pcmsg->cmsg_level != SOL_SOCKET || pcmsg->cmsg_type != SCM_RIGHTS) {
+          continue;
+        }
+        int count = int((pcmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        int *precv = (int *)CMSG_DATA(pcmsg);
+        for (int i = 0; i < count; i++) {
+          if (nfds < maxfds) {
+            fds[nfds++] = precv[i];
+          } else if (close(precv[i]) != 0) {
+            ErrorInfo(errno);
+          }
+        }
+      }
+      return std::make_tuple<size_t, ErrNo>(size_t(irecv), 0);
+    }
+    int err = errno;
+    if (err != EAGAIN) {
+      return std::make_tuple<size_t, ErrNo>(size_t(0), ErrNo(err));
+    }
+    m_inWait = ctx;
+    ctx->Out();
+  }
+}
+
 void TcpSocket::Close() {
   if (-1 == m_fd) {
     return;
@@ -401,7 +543,7 @@ void TcpSocket::Close() {
   }
   m_fd = -1;
   m_sendFail = false;
-  m_writeBuffer.clear();
+  clearWrite();
   if (m_connWait != nullptr) {
     GoContext *tmpWait = m_connWait;
     m_connWait = nullptr;
@@ -412,6 +554,16 @@ void TcpSocket::Close() {
     m_inWait = nullptr;
     m_epoll->push([tmpWait]() { tmpWait->In(); });
   }
+  if (m_inSel != nullptr) {
+    Selector *tmpSel = m_inSel;
+    m_inSel = nullptr;
+    tmpSel->Fire(m_inIndex);
+  }
+  if (m_inAsync != nullptr) {
+    AsyncWaiter *tmpAsync = m_inAsync;
+    m_inAsync = nullptr;
+    m_epoll->push([tmpAsync]() { tmpAsync->OnReady(); });
+  }
 }
 
 void TcpSocket::OnIn() {
@@ -426,6 +578,16 @@ void TcpSocket::OnIn() {
     m_inWait = nullptr;
     tmpWait->In();
   }
+  if (m_inSel != nullptr) {
+    Selector *tmpSel = m_inSel;
+    m_inSel = nullptr;
+    tmpSel->Fire(m_inIndex);
+  }
+  if (m_inAsync != nullptr) {
+    AsyncWaiter *tmpAsync = m_inAsync;
+    m_inAsync = nullptr;
+    tmpAsync->OnReady();
+  }
 }
 
 void TcpSocket::OnOut() {
@@ -435,30 +597,59 @@ void TcpSocket::OnOut() {
     tmpWait->In();
     return;
   }
-  auto len = m_writeBuffer.size();
-  if (len == 0) {
-    return;
+  // 先发完已经发出一部分的低优先级整体,再发高优先级数据,最后是其余的
+  if (m_bulkCut) {
+    flushBulk();
+    if (m_bulkCut || m_sendFail) {
+      return;
+    }
   }
-  size_t total = 0;
-  while (total != len) {
-    auto isend = send(m_fd, &(m_writeBuffer[total]), len - total, 0);
-    if (isend >= 0) {
-      total += isend;
-      continue;
+  auto len = m_writeBuffer.size() - m_writeHead;
+  if (len != 0) {
+    size_t total = sendSome(&(m_writeBuffer[m_writeHead]), len);
+    if (m_sendFail) {
+      clearWrite();
+      return;
     }
-    if (errno != EAGAIN) {
-      m_sendFail = true;
-      m_writeBuffer.clear();
+    dropSent(m_writeBuffer, m_writeHead, total);
+    if (total != len) {
       return;
     }
-    break;
   }
-  if (total == len) {
-    m_writeBuffer.clear();
+  flushBulk();
+}
+
+void TcpSocket::flushBulk() {
+  auto len = m_bulkBuffer.size() - m_bulkHead;
+  if (len == 0) {
+    return;
+  }
+  // 被截断的整体只发到它的结尾
+  size_t limit = m_bulkCut ? m_bulkUnits.front() : len;
+  size_t total = sendSome(&(m_bulkBuffer[m_bulkHead]), limit);
+  if (m_sendFail) {
+    clearWrite();
     return;
   }
-  memcpy(&(m_writeBuffer[0]), &(m_writeBuffer[total]), len - total);
-  m_writeBuffer.resize(len - total);
+  dropSent(m_bulkBuffer, m_bulkHead, total);
+  size_t sent = total;
+  while (sent > 0 && sent >= m_bulkUnits.front()) {
+    sent -= m_bulkUnits.front();
+    m_bulkUnits.pop_front();
+  }
+  m_bulkCut = sent > 0;
+  if (m_bulkCut) {
+    m_bulkUnits.front() -= sent;
+  }
+}
+
+void TcpSocket::clearWrite() {
+  m_writeBuffer.clear();
+  m_writeHead = 0;
+  m_bulkBuffer.clear();
+  m_bulkHead = 0;
+  m_bulkUnits.clear();
+  m_bulkCut = false;
 }
 
 UdpSocket::UdpSocket(Epoll *e) {
@@ -601,3 +792,283 @@ void UdpSocket::OnOut() {
   memcpy(&(m_writeBuffer[0]), &(m_writeBuffer[total]), size - total);
   m_writeBuffer.resize(size - total);
 }
+
+EventFd::EventFd(Epoll *e) {
+  m_epoll = e;
+  m_inWait = nullptr;
+  m_fd = -1;
+}
+
+EventFd::~EventFd() { Close(); }
+
+ErrNo EventFd::Open() {
+  if (m_fd != -1) {
+    return EEXIST;
+  }
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd == -1) {
+    return errno;
+  }
+  int iadd = m_epoll->add(fd, this);
+  if (iadd != 0) {
+    if (close(fd) != 0) {
+      ErrorInfo(errno);
+    }
+    return iadd;
+  }
+  m_fd = fd;
+  return 0;
+}
+
+ErrNo EventFd::Open(int fd) {
+  if (m_fd != -1) {
+    return EEXIST;
+  }
+  int iset = SetNoblock(fd);
+  if (iset != 0) {
+    if (close(fd) != 0) {
+      ErrorInfo(errno);
+    }
+    return iset;
+  }
+  int iadd = m_epoll->add(fd, this);
+  if (iadd != 0) {
+    if (close(fd) != 0) {
+      ErrorInfo(errno);
+    }
+    return iadd;
+  }
+  m_fd = fd;
+  return 0;
+}
+
+ErrNo EventFd::Wait(GoContext *ctx) {
+  while (true) {
+    if (m_fd == -1) {
+      return EBADF;
+    }
+    uint64_t value = 0;
+    auto iread = read(m_fd, &value, sizeof(value));
+    if (iread == sizeof(value)) {
+      return 0;
+    }
+    int err = errno;
+    if (err != EAGAIN) {
+      return err;
+    }
+    m_inWait = ctx;
+    ctx->Out();
+  }
+}
+
+void EventFd::Notify() {
+  if (m_fd == -1) {
+    return;
+  }
+  uint64_t value = 1;
+  if (write(m_fd, &value, sizeof(value)) != sizeof(value)) {
+    ErrorInfo(errno);
+  }
+}
+
+void EventFd::Close() {
+  if (-1 == m_fd) {
+    return;
+  }
+  m_epoll->del(m_fd, this);
+  if (close(m_fd) != 0) {
+    ErrorInfo(errno);
+  }
+  m_fd = -1;
+  if (m_inWait == nullptr) {
+    return;
+  }
+  GoContext *tmpWait = m_inWait;
+  m_inWait = nullptr;
+  m_epoll->push([tmpWait]() { tmpWait->In(); });
+}
+
+void EventFd::OnIn() {
+  if (m_inWait == nullptr) {
+    return;
+  }
+  GoContext *tmpWait = m_inWait;
+  m_inWait = nullptr;
+  tmpWait->In();
+}
+
+void EventFd::OnOut() {}
+
+namespace {
+ErrNo writeAll(int fd, const uint8_t *data, size_t len, off_t offset) {
+  while (len > 0) {
+    auto iwrite = pwrite(fd, data, len, offset);
+    if (iwrite < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    data += iwrite;
+    len -= size_t(iwrite);
+    offset += iwrite;
+  }
+  return 0;
+}
+}  // namespace
+
+AsyncFile::AsyncFile() {
+  m_fd = -1;
+  m_appendOffset = 0;
+  m_err = 0;
+  m_flushing = false;
+  m_fill = 0;
+  m_writes = 0;
+  m_syncs = 0;
+}
+
+AsyncFile::~AsyncFile() { Close(); }
+
+ErrNo AsyncFile::Open(const char *path, int flags, mode_t mode) {
+  if (m_fd != -1) {
+    return EBUSY;
+  }
+  int fd = open(path, flags | O_CLOEXEC, mode);
+  if (fd == -1) {
+    return errno;
+  }
+  off_t end = lseek(fd, 0, SEEK_END);
+  if (end == -1) {
+    int err = errno;
+    close(fd);
+    return err;
+  }
+  m_fd = fd;
+  m_appendOffset = end;
+  m_err = 0;
+  return 0;
+}
+
+std::tuple<size_t, ErrNo> AsyncFile::ReadAt(GoContext *ctx, void *buf,
+                                            size_t len, off_t offset) {
+  int fd = m_fd;
+  ssize_t iread = -1;
+  ErrNo err = 0;
+  ErrNo oerr = ctx->Offload([&]() {
+    do {
+      iread = pread(fd, buf, len, offset);
+    } while (iread < 0 && errno == EINTR);
+    if (iread < 0) {
+      err = errno;
+    }
+  });
+  if (oerr != 0) {
+    return std::make_tuple(size_t(0), oerr);
+  }
+  if (err != 0) {
+    return std::make_tuple(size_t(0), err);
+  }
+  return std::make_tuple(size_t(iread), ErrNo(0));
+}
+
+ErrNo AsyncFile::WriteAt(GoContext *ctx, const void *buf, size_t len,
+                         off_t offset) {
+  int fd = m_fd;
+  ErrNo err = 0;
+  ErrNo oerr = ctx->Offload([&]() {
+    err = writeAll(fd, static_cast<const uint8_t *>(buf), len, offset);
+  });
+  return oerr != 0 ? oerr : err;
+}
+
+ErrNo AsyncFile::Fsync(GoContext *ctx) {
+  int fd = m_fd;
+  ErrNo err = 0;
+  ErrNo oerr = ctx->Offload([&]() {
+    if (fsync(fd) != 0) {
+      err = errno;
+    }
+  });
+  return oerr != 0 ? oerr : err;
+}
+
+// 第一个发现没有写入进行中的协程负责写出,直到没有新追加的数据
+ErrNo AsyncFile::Append(GoContext *ctx, const void *buf, size_t len,
+                        bool sync) {
+  if (m_err != 0) {
+    return m_err;
+  }
+  AppendBatch *batch = &m_batches[m_fill];
+  auto data = static_cast<const uint8_t *>(buf);
+  batch->Data.insert(batch->Data.end(), data, data + len);
+  batch->Sync = batch->Sync || sync;
+  if (m_flushing) {
+    batch->Waits.Wait(ctx);
+    if (!batch->Lead) {
+      return batch->Err;
+    }
+    // 上一批的写入者把这一批交给了本协程
+    batch->Lead = false;
+  }
+  m_flushing = true;
+  m_fill = 1 - m_fill;
+  flush(ctx, *batch);
+  ErrNo err = batch->Err;
+  batch->Data.clear();
+  batch->Sync = false;
+  batch->Waits.WakeAll();
+  // 每个协程只写一批,持续有Append时也能返回
+  AppendBatch &next = m_batches[m_fill];
+  if (next.Waits.Empty()) {
+    m_flushing = false;
+  } else {
+    next.Lead = true;
+    next.Waits.WakeOne();
+  }
+  return err;
+}
+
+void AsyncFile::flush(GoContext *ctx, AppendBatch &batch) {
+  if (m_err != 0) {
+    batch.Err = m_err;
+    return;
+  }
+  int fd = m_fd;
+  const uint8_t *data = batch.Data.data();
+  size_t len = batch.Data.size();
+  off_t offset = m_appendOffset;
+  bool sync = batch.Sync;
+  ErrNo err = 0;
+  ErrNo oerr = ctx->Offload([&]() {
+    err = writeAll(fd, data, len, offset);
+    if (err == 0 && sync && fdatasync(fd) != 0) {
+      err = errno;
+    }
+  });
+  if (oerr != 0) {
+    // 没有执行,不影响之后的Append
+    batch.Err = oerr;
+    return;
+  }
+  batch.Err = err;
+  if (err != 0) {
+    m_err = err;
+    ErrorInfo(err);
+    return;
+  }
+  m_appendOffset += off_t(len);
+  ++m_writes;
+  if (sync) {
+    ++m_syncs;
+  }
+}
+
+void AsyncFile::Close() {
+  if (m_fd == -1) {
+    return;
+  }
+  if (close(m_fd) != 0) {
+    ErrorInfo(errno);
+  }
+  m_fd = -1;
+}
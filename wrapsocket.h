@@ -1,11 +1,14 @@
 #pragma once
 
 #include <netinet/in.h>
+#include <sys/types.h>
 
+#include <deque>
 #include <tuple>
 #include <vector>
 
 #include "epoll.h"
+#include "gosync.h"
 
 void SockAddr(sockaddr_in &addr, const char *szip, uint16_t port);
 
@@ -25,8 +28,10 @@ class AcceptSocket : public INotify {
   virtual void OnOut() override;
 
  private:
+  friend class AsyncAccept;
   Epoll *m_epoll;
   GoContext *m_inWait;
+  AsyncWaiter *m_inAsync;
   int m_fd;
 };
 
@@ -41,25 +46,48 @@ class TcpSocket : public INotify {
                 unsigned int seconds);
   ErrNo Connect(GoContext *ctx, const char *unixPath, unsigned int seconds);
   void Write(const void *buf, size_t nbytes);
+  // 低优先级写入,每次调用的数据作为一个整体
+  // 发送缓冲区积压时,Write的数据在整体之间插队,先于积压的低优先级数据发出
+  void WriteBulk(const void *buf, size_t nbytes);
   std::tuple<size_t, ErrNo> Read(GoContext *ctx, void *buf, size_t nbytes);
+  // unix socket上随数据传递文件描述符
+  ErrNo WriteFds(const void *buf, size_t nbytes, const int *fds, int nfds);
+  std::tuple<size_t, ErrNo> ReadFds(GoContext *ctx, void *buf, size_t nbytes,
+                                    int *fds, int &nfds);
   void Close();
 
  private:
   ErrNo doConnectWithTimeout(GoContext *ctx, const sockaddr *addr,
                              socklen_t len, unsigned int seconds);
   ErrNo doConnect(GoContext *ctx, const sockaddr *addr, socklen_t len);
+  size_t sendSome(const uint8_t *buf, size_t nbytes);
+  void flushBulk();
+  void clearWrite();
 
  private:
   virtual void OnIn() override;
   virtual void OnOut() override;
 
  private:
+  friend class SelectReadable;
+  friend class AsyncRead;
   Epoll *m_epoll;
   GoContext *m_inWait;
   GoContext *m_connWait;
+  AsyncWaiter *m_inAsync;
+  // Select等待可读时的唤醒目标
+  Selector *m_inSel;
+  int m_inIndex;
   int m_fd;
   bool m_sendFail;
   std::vector<uint8_t> m_writeBuffer;
+  size_t m_writeHead;
+  // 积压的低优先级数据,m_bulkUnits为每个整体剩余的字节数
+  std::vector<uint8_t> m_bulkBuffer;
+  size_t m_bulkHead;
+  std::deque<size_t> m_bulkUnits;
+  // 第一个整体已经发出了一部分,必须先发完
+  bool m_bulkCut;
 };
 
 class UdpSocket : public INotify {
@@ -85,3 +113,74 @@ class UdpSocket : public INotify {
   int m_fd;
   std::vector<uint8_t> m_writeBuffer;
 };
+
+class EventFd : public INotify {
+ public:
+  EventFd(Epoll *e);
+  EventFd(const EventFd &) = delete;
+  EventFd &operator=(const EventFd &) = delete;
+  ~EventFd();
+  ErrNo Open();
+  ErrNo Open(int fd);
+  int Fd() { return m_fd; }
+  ErrNo Wait(GoContext *ctx);
+  void Notify();
+  void Close();
+
+ private:
+  virtual void OnIn() override;
+  virtual void OnOut() override;
+
+ private:
+  Epoll *m_epoll;
+  GoContext *m_inWait;
+  int m_fd;
+};
+/*
+  磁盘文件,读写和fsync通过GoContext::Offload在Epoll设置的OffloadPool中执行
+  读写期间协程挂起,同一Epoll上的socket照常处理
+  Append为组提交:一次写入进行时,其他协程追加的数据拼成下一批,
+  上一批完成后一次write(和fdatasync)写出,各批按追加顺序写到文件末尾
+  写完一批的协程把下一批交给该批第一个追加的协程,自己返回
+  写入或fsync失败后,之后的Append都返回同一个错误
+  同一个AsyncFile只在所属Epoll的线程中使用,Close前要保证没有进行中的调用
+*/
+class AsyncFile {
+ public:
+  AsyncFile();
+  AsyncFile(const AsyncFile &) = delete;
+  AsyncFile &operator=(const AsyncFile &) = delete;
+  ~AsyncFile();
+  ErrNo Open(const char *path, int flags, mode_t mode = 0644);
+  std::tuple<size_t, ErrNo> ReadAt(GoContext *ctx, void *buf, size_t len,
+                                   off_t offset);
+  ErrNo WriteAt(GoContext *ctx, const void *buf, size_t len, off_t offset);
+  // 返回时数据已经写入文件,sync为true时同一批还做了fdatasync
+  ErrNo Append(GoContext *ctx, const void *buf, size_t len, bool sync);
+  ErrNo Fsync(GoContext *ctx);
+  void Close();
+  // Append实际执行的write和fdatasync次数
+  uint64_t AppendWrites() const { return m_writes; }
+  uint64_t AppendSyncs() const { return m_syncs; }
+
+ private:
+  struct AppendBatch {
+    std::vector<uint8_t> Data;
+    bool Sync = false;
+    ErrNo Err = 0;
+    // 被唤醒的第一个协程负责写这一批
+    bool Lead = false;
+    GoWaitList Waits;
+  };
+  void flush(GoContext *ctx, AppendBatch &batch);
+
+ private:
+  int m_fd;
+  off_t m_appendOffset;
+  ErrNo m_err;
+  bool m_flushing;
+  int m_fill;
+  AppendBatch m_batches[2];
+  uint64_t m_writes;
+  uint64_t m_syncs;
+};